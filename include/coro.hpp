@@ -0,0 +1 @@
+../src/coro.hpp
\ No newline at end of file
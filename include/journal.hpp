@@ -0,0 +1 @@
+../src/journal.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../src/pipeline.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../src/writer.hpp
\ No newline at end of file
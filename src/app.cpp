@@ -1,33 +1,176 @@
 #include "app.hpp"
 
 #include <signal.h>
+#include <list>
+#include <unordered_map>
 
 using namespace OUCH;
   
 Log* App::_defaultLog;
 
-static std::map<int, sessions_t> _sharedSessions; // server sessions share the same acceptor socket fd
-static std::map<int, int> _port2fd; // acceptor port to acceptor socket fd
 static std::mutex _m;
 typedef std::lock_guard<std::mutex> lock_t;
 
 namespace OUCH {
+struct Acceptor;
+
+// A connection accepted on a port, until its login request is in
+struct PendingLogin : public i_poll_events
+{
+  PendingLogin(Acceptor& acceptor, int fd) : fd(fd), len(0), _acceptor(acceptor) {}
+  void in_event(int);
+
+  int fd;
+  epoll_t::handle_t handle;
+  std::chrono::steady_clock::time_point accepted;
+  std::list<PendingLogin*>::iterator pos; // in Acceptor::_pending
+  char login[sizeof(soupbin3_packet_login_request)];
+  size_t len;
+
+private:
+  Acceptor& _acceptor;
+};
+
+// The server sessions listening on a port, by username as sent in a login
+// request, that is cut to its 6 characters.
+struct Port
+{
+  std::unordered_map<str_t, Session*> users;
+  std::vector<Acceptor*> acceptors;
+  int loginTimeout; // seconds
+};
+
+// One of the listening sockets of a port. With AcceptShards above 1 a port
+// has that many, each on the reactor of one of its first sessions and bound
+// with SO_REUSEPORT, so that the kernel spreads connections across them.
+// Connections are handed to the session their login request names, the
+// ones that do not send one within LoginTimeout are dropped off a timer.
 struct Acceptor : public i_poll_events
 {
+  Acceptor(Port& port, epoll_t* poll);
   void in_event(int);
+  void route(PendingLogin* p);
+  void drop(PendingLogin* p, bool close=true);
+
+private:
+  void expire();
+
+  Port& _port;
+  epoll_t* _poll;
+  int _tfd; // one shot, armed for the oldest pending login
+  std::list<PendingLogin*> _pending; // oldest first
 };
 }
 
-static Acceptor _acceptor;
+static std::map<int, Port> _ports; // by port number
 
 void App::init(cstr_t& settingsFile)
-{ _sessions = Session::createSessions(settingsFile); }
+{ _sessions = Session::createSessions(settingsFile); configure(); }
 
 void App::init(std::istream& stream)
-{ _sessions = Session::createSessions(stream); }
+{ _sessions = Session::createSessions(stream); configure(); }
 
 void App::init(const sessions_t& sessions)
-{ _sessions = sessions; }
+{ _sessions = sessions; configure(); }
+
+// settings of the App, taken from the first session
+void App::configure()
+{
+  if (!_sessions.empty()) _reactorThreads = _sessions.front()->get("ReactorThreads", 0);
+}
+
+// Runs f for every session on a pool of InitThreads threads (setting of the
+// first session, the number of CPUs by default), rethrowing the first error.
+static void forEach(const sessions_t& sessions, std::function<void(Session*)> f)
+{
+  if (sessions.empty()) return;
+  size_t n = sessions.front()->get("InitThreads", (int)std::thread::hardware_concurrency());
+  n = std::max((size_t)1, std::min(n, sessions.size()));
+  std::atomic<size_t> next(0);
+  std::exception_ptr error;
+  std::mutex m;
+  auto work = [&]() {
+    for (size_t i; (i = next++) < sessions.size();) {
+      try {
+        f(sessions[i]);
+      } catch (...) {
+        std::lock_guard<std::mutex> l(m);
+        if (!error) error = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n; ++i) threads.push_back(std::thread(work));
+  work();
+  for (auto& t : threads) t.join();
+  if (error) std::rethrow_exception(error);
+}
+
+static double msSince(std::chrono::steady_clock::time_point& t)
+{
+  auto now = std::chrono::steady_clock::now();
+  auto ms = std::chrono::duration<double, std::milli>(now - t).count();
+  t = now;
+  return ms;
+}
+
+// stores and logs open files and recover, which is what makes a restart
+// slow, so sessions get theirs in parallel
+void App::createStores(const sessions_t& sessions)
+{
+  forEach(sessions, [this](Session* s) {
+    auto t = std::chrono::steady_clock::now();
+    s->_store = _storeFactory->create(*s);
+    s->_log = _logFactory->create(*s);
+    s->event(""); // new line
+    s->event("Created session in %.1fms", msSince(t));
+  });
+}
+
+// With WarmUp set, the first order should not be the one to fault in the
+// buffers, allocate thread-locals or run cold code: every session and the
+// chunk pools are faulted in, and pinned too with WarmUpLock, and
+// WarmUpCycles (1000 by default) rounds of every message type go through
+// encoding, the outbound pipe, decoding and log formatting, which leaves
+// the wire, the stores and the application untouched. Settings of the
+// first session.
+void App::warmUp(const sessions_t& sessions)
+{
+  auto s0 = sessions.front();
+  if (!s0->get("WarmUp", 0)) return;
+  int cycles = s0->get("WarmUpCycles", 1000);
+  bool lock = s0->get("WarmUpLock", 0);
+  std::atomic<bool> locked(true);
+  forEach(sessions, [&](Session* s) { if (!s->warmUp(cycles, lock)) locked = false; });
+  if (_defaultLog && !_defaultLog->warmUp(lock)) locked = false;
+  // a spare in every pool at least, for the first chunk to fill up
+  auto chunk = [&](MYPIPE::Chunk& c) { if (!prefault(c.data, c.capacity, lock)) locked = false; };
+  MYPIPE::ChunkPool<MYPIPE::Chunk>::forEachPool([&](MYPIPE::ChunkPool<MYPIPE::Chunk>& p) {
+    if (!p.available()) p.reserve(p.allocated() + 1);
+    p.forEach(chunk);
+  });
+  auto queueChunk = [&](Chunk& c) { if (!prefault(c.data, c.capacity, lock)) locked = false; };
+  MYPIPE::ChunkPool<Chunk>::forEachPool([&](MYPIPE::ChunkPool<Chunk>& p) {
+    if (!p.available()) p.reserve(p.allocated() + 1);
+    p.forEach(queueChunk);
+  });
+  for (auto poll : _polls) poll->post([]() { nowUtcStr(); });
+  if (!locked) s0->event("Could not lock all buffers in memory, see ulimit -l");
+}
+
+void App::reportStartup(const char* what, const char* phase, size_t n, double setupMs, double storesMs, double warmUpMs, double startMs)
+{
+  _startupStats.sessions = n;
+  _startupStats.setupMs = setupMs;
+  _startupStats.storesMs = storesMs;
+  _startupStats.warmUpMs = warmUpMs;
+  _startupStats.startMs = startMs;
+  char buf[256];
+  snprintf(buf, sizeof(buf), "Started %zu %s in %.1fms: setup %.1fms, stores and logs %.1fms, warm-up %.1fms, %s %.1fms",
+      n, what, setupMs + storesMs + warmUpMs + startMs, setupMs, storesMs, warmUpMs, phase, startMs);
+  if (_defaultLog) _defaultLog->onEvent(buf);
+  else if (_defaultSession) _defaultSession->event("%s", buf);
+}
 
 static void avoidSIGPIP()
 {
@@ -42,120 +185,249 @@ static void avoidSIGPIP()
 void App::connect()
 {
   avoidSIGPIP();
-  if (!_threaded && _polls.empty()) _polls.push_back(new epoll_t);
-  int n = 0;
+  auto t = std::chrono::steady_clock::now();
+  if (!_threaded) reactor();
+  sessions_t sessions;
   for (auto it = _sessions.begin(); it != _sessions.end(); ++it) {
     auto s = *it;
     if (!s->isClient()) continue;
     if (s->_app) die("can not assign session '" + s->_id + "' to App twice");
-    n++;
+    sessions.push_back(s);
     s->_app = this;
     onCreate(*s);
     _activeSessions.push_back(s);
     if (!_defaultSession) _defaultSession = s;
-    s->_store = _storeFactory->create(*s);
-    s->_log = _logFactory->create(*s);
     epoll_t *poll, *poll2;
-    if (_threaded) {
-      poll = new epoll_t;
-      _polls.push_back(poll);
-      poll2 = poll; // in my test, sharing poll faster
-      //poll2 = new epoll_t;
-      //_polls.push_back(poll2);
-    } else
-      poll2 = poll = _polls.front();
+    poll2 = poll = sessionReactor(); // in my test, sharing poll faster
     s->_poll = poll;
     s->_outpoll = poll2;
     poll->set_pollin(poll->add_fd(s->_tfd, s->_timer));
-    s->event(""); // new line
-    s->event("Created session");
-    s->connect(true);
   }
 
-  if (n == 0) die("no FIX clients found in the settings file");
-  
-  for (auto i = _threads.size(); i < _polls.size(); ++i) 
-    _threads.push_back(new std::thread([=](){_polls[i]->loop();}));
+  if (sessions.empty()) die("no FIX clients found in the settings file");
+
+  auto setupMs = msSince(t);
+  createStores(sessions);
+  auto storesMs = msSince(t);
+  warmUp(sessions);
+  auto warmUpMs = msSince(t);
+  // threaded sessions connect in parallel
+  if (_threaded) forEach(sessions, [](Session* s) { s->connect(true); });
+  else for (auto s : sessions) s->connect(true);
+  reportStartup("clients", "connecting", sessions.size(), setupMs, storesMs, warmUpMs, msSince(t));
+
+  startThreads();
 }
 
 void App::listen()
 {
   avoidSIGPIP();
-  if (!_threaded && _polls.empty()) _polls.push_back(new epoll_t);
-  int n = 0;
+  auto t = std::chrono::steady_clock::now();
+  if (!_threaded) reactor();
+  sessions_t sessions;
   for (auto it0 = _sessions.begin(); it0 != _sessions.end(); ++it0) {
     auto s = *it0;
     if (s->isClient()) continue;
     if (s->_app) die("can not assign session '" + s->_id + "' to App twice");
-    n++;
+    sessions.push_back(s);
     s->_app = this;
     onCreate(*s);
     _activeSessions.push_back(s);
     if (!_defaultSession) _defaultSession = s;
-    s->_store = _storeFactory->create(*s);
-    s->_log = _logFactory->create(*s);
-    if (!_defaultLog) _defaultLog = _logFactory->create();
+  }
+
+  if (sessions.empty()) die("no FIX servers found in the settings file");
+
+  auto setupMs = msSince(t);
+  createStores(sessions);
+  if (!_defaultLog) _defaultLog = _logFactory->create();
+  auto storesMs = msSince(t);
+  warmUp(sessions);
+  auto warmUpMs = msSince(t);
+
+  for (auto it0 = sessions.begin(); it0 != sessions.end(); ++it0) {
+    auto s = *it0;
     auto port = s->get("SocketAcceptPort", 0);
-    int fd;
-    auto it = _port2fd.find(port);
     epoll_t *poll, *poll2;
-    if (_threaded) {
-      poll = new epoll_t;
-      _polls.push_back(poll);
-      poll2 = poll;
-      //poll2 = new epoll_t;
-      //_polls.push_back(poll2);
-    } else
-      poll2 = poll = _polls.front();
-    if (it == _port2fd.end()) {
-      fd = createAcceptor(port);
-      auto rsize = s->get("ReceiveBufferSize", 0);
-      auto ssize = s->get("SendBufferSize", 0);
-      if (rsize > 0) setSockOpt(fd, SO_RCVBUF, rsize);
-      if (ssize > 0) setSockOpt(fd, SO_SNDBUF, ssize);
-      _port2fd[port] = fd;
-      poll->set_pollin(poll->add_fd(fd, &_acceptor));
-    } else
-      fd = it->second;
+    poll2 = poll = sessionReactor();
     s->_poll = poll;
     s->_outpoll = poll2;
     poll->set_pollin(poll->add_fd(s->_tfd, s->_timer));
     {
       lock_t lock(_m);
-      _sharedSessions[fd].push_back(s);
+      auto& p = _ports[port];
+      auto user = s->username().substr(0, sizeof(soupbin3_packet_login_request().Username));
+      if (!p.users.insert(std::make_pair(user, s)).second)
+        die("duplicate username '" + user + "' on port " + itoa(port));
+      size_t shards = s->get("AcceptShards", 1);
+      if (p.acceptors.size() < shards) {
+        auto fd = createAcceptor(port, shards > 1);
+        auto rsize = s->get("ReceiveBufferSize", 0);
+        auto ssize = s->get("SendBufferSize", 0);
+        if (rsize > 0) setSockOpt(fd, SO_RCVBUF, rsize);
+        if (ssize > 0) setSockOpt(fd, SO_SNDBUF, ssize);
+        if (p.acceptors.empty()) p.loginTimeout = s->get("LoginTimeout", 5);
+        p.acceptors.push_back(new Acceptor(p, poll));
+        poll->set_pollin(poll->add_fd(fd, p.acceptors.back()));
+      }
     }
-    s->event("Created session");
     s->event("Listening on port %d", port);
   }
+  reportStartup("servers", "acceptors", sessions.size(), setupMs, storesMs, warmUpMs, msSince(t));
 
-  if (n == 0) die("no FIX servers found in the settings file");
+  startThreads();
+}
 
+void App::startThreads()
+{
+  if (_externalLoop) return;
   for (auto i = _threads.size(); i < _polls.size(); ++i) 
     _threads.push_back(new std::thread([=](){_polls[i]->loop();}));
 }
 
+// Threaded sessions get a reactor each, or with ReactorThreads set share
+// that many, taking turns; 10k sessions do not need 10k threads.
+epoll_t* App::sessionReactor()
+{
+  if (!_threaded) return reactor();
+  if (!_reactorThreads || _polls.size() < _reactorThreads) {
+    _polls.push_back(new epoll_t);
+    return _polls.back();
+  }
+  return _polls[_nextReactor++ % _polls.size()];
+}
+
+epoll_t* App::reactor()
+{
+  if (_polls.empty()) _polls.push_back(new epoll_t);
+  return _polls.front();
+}
+
+epoll_t::handle_t App::addFd(int fd, i_poll_events* events, bool in, bool out)
+{
+  auto poll = reactor();
+  auto handle = poll->add_fd(fd, events);
+  if (in) poll->set_pollin(handle);
+  if (out) poll->set_pollout(handle);
+  return handle;
+}
+
+Acceptor::Acceptor(Port& port, epoll_t* poll) : _port(port), _poll(poll)
+{
+  _tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (_tfd < 0) dieerr("Could not create login timer");
+  _poll->set_pollin(_poll->add_fd(_tfd, this));
+}
+
+// Accepts what is queued, in a bounded batch so that a storm of reconnects
+// does not hold up the sessions sharing this reactor.
 void Acceptor::in_event(int fd)
 {
-  auto peer = accept(fd, NULL, NULL);
-  if (peer < 0) return;
-  setSockOpt(peer, TCP_NODELAY, getSockOpt(peer, TCP_NODELAY));
-  setSockOpt(peer, SO_SNDBUF, getSockOpt(peer, SO_SNDBUF));
-  setSockOpt(peer, SO_RCVBUF, getSockOpt(peer, SO_RCVBUF));
-  Session::event(NULL, "Accepted connection from %s on port %d", getHostName(peer), getHostPort(peer));
-  Session::event(NULL, "recv/send_buf=%d/%d tcp_nodelay=%d", 
-        getSockOpt(peer, SO_RCVBUF),
-        getSockOpt(peer, SO_SNDBUF),
-        getSockOpt(peer, TCP_NODELAY));
-  
-  // a simple server implementation just for test, no username check
-  for (auto it = _sharedSessions[fd].begin(); it != _sharedSessions[fd].end(); ++it) {
-    auto s = *it;
-    if (s->_fd < 0) {
-      s->start(peer);
-      return;
+  if (fd == _tfd) {
+    expire();
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  auto idle = _pending.empty();
+  for (int i = 0; i < 64; ++i) {
+    auto peer = accept4(fd, NULL, NULL, SOCK_NONBLOCK);
+    if (peer < 0) return;
+    setSockOpt(peer, TCP_NODELAY, getSockOpt(peer, TCP_NODELAY));
+    setSockOpt(peer, SO_SNDBUF, getSockOpt(peer, SO_SNDBUF));
+    setSockOpt(peer, SO_RCVBUF, getSockOpt(peer, SO_RCVBUF));
+    Session::event(NULL, "Accepted connection from %s on port %d", getHostName(peer), getHostPort(peer));
+    Session::event(NULL, "recv/send_buf=%d/%d tcp_nodelay=%d", 
+          getSockOpt(peer, SO_RCVBUF),
+          getSockOpt(peer, SO_SNDBUF),
+          getSockOpt(peer, TCP_NODELAY));
+    auto p = new PendingLogin(*this, peer);
+    p->accepted = now;
+    p->handle = _poll->add_fd(peer, p);
+    _poll->set_pollin(p->handle);
+    p->pos = _pending.insert(_pending.end(), p);
+    if (idle) {
+      setTimerMs(_tfd, std::max(1, _port.loginTimeout * 1000));
+      idle = false;
     }
   }
-  closeSock(peer);
+}
+
+// drops the connections that did not send a login request within
+// LoginTimeout and arms the timer for the next one to run out
+void Acceptor::expire()
+{
+  uint64_t n;
+  if (::read(_tfd, &n, sizeof(n))) {}
+  auto now = std::chrono::steady_clock::now();
+  auto timeout = std::chrono::seconds(_port.loginTimeout);
+  while (!_pending.empty() && now - _pending.front()->accepted >= timeout) {
+    Session::event(NULL, "No login request from %s", getPeerName(_pending.front()->fd));
+    drop(_pending.front());
+  }
+  if (_pending.empty()) return;
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(_pending.front()->accepted + timeout - now);
+  setTimerMs(_tfd, std::max(1, (int)left.count()));
+}
+
+static void rejectLogin(int fd, char reason)
+{
+  soupbin3_packet_login_rejected msg;
+  msg.PacketLength = htons(sizeof(msg)-2);
+  msg.PacketType = SOUPBIN3_PACKET_LOGIN_REJECTED;
+  msg.RejectReasonCode = reason;
+  if (::write(fd, &msg, sizeof(msg))) {}
+  closeSock(fd);
+}
+
+void PendingLogin::in_event(int)
+{
+  auto nr = ::read(fd, login + len, sizeof(login) - len);
+  if (nr == 0 || (nr < 0 && errno != EAGAIN && errno != EINTR)) {
+    _acceptor.drop(this);
+    return;
+  }
+  if (nr < 0) return;
+  len += nr;
+  auto msg = (soupbin3_packet_login_request*)login;
+  if (len >= 3 && (msg->PacketType != SOUPBIN3_PACKET_LOGIN_REQUEST 
+        || ntohs(msg->PacketLength) != sizeof(*msg)-2)) {
+    Session::event(NULL, "Expected a login request from %s", getPeerName(fd));
+    _acceptor.drop(this);
+    return;
+  }
+  if (len == sizeof(login)) _acceptor.route(this);
+}
+
+// hands the connection to the session named in its login request, on the
+// session's own reactor, where the request is processed as if read there
+void Acceptor::route(PendingLogin* p)
+{
+  auto fd = p->fd;
+  str_t login(p->login, sizeof(p->login));
+  drop(p, false);
+  auto msg = (soupbin3_packet_login_request*)login.data();
+  auto user = rtrim(str_t(msg->Username, sizeof(msg->Username)));
+  auto it = _port.users.find(user);
+  auto s = it == _port.users.end() ? NULL : it->second;
+  if (!s || rtrim(str_t(msg->Password, sizeof(msg->Password)))
+      != rtrim(s->password().substr(0, sizeof(msg->Password)))) {
+    Session::event(NULL, "Login rejected for '%s' from %s: not authorized", user.c_str(), getPeerName(fd));
+    rejectLogin(fd, 'A');
+    return;
+  }
+  s->post([s, fd, login]() {
+    if (s->accept(fd, login.data(), login.size())) return;
+    s->event("Login rejected: session in use");
+    rejectLogin(fd, 'S');
+  });
+}
+
+void Acceptor::drop(PendingLogin* p, bool close)
+{
+  _poll->rm_fd(p->handle);
+  if (close) closeSock(p->fd);
+  _pending.erase(p->pos);
+  delete p;
 }
  
 void App::wait()
@@ -5,16 +5,25 @@
 #include "store.hpp"
 #include "log.hpp"
 #include "ouch.hpp"
+#include "pipeline.hpp"
 
+#include <chrono>
 #include <thread>
 
 namespace OUCH {
 
+/**
+ * Runs the sessions of a settings file. By default each session has an
+ * AsyncFileStore and an AsyncFileLog, each with a thread of its own, and a
+ * reactor thread unless ReactorThreads is set. For many sessions use
+ * JournalStore and JournalLog with JournalShared, and set ReactorThreads;
+ * see README.md.
+ */
 class App : public noncopyable
 {
 public:
-  App() : _threaded(true), _storeFactory(new StoreFactoryTmpl<AsyncFileStore>), _logFactory(new LogFactoryTmpl<AsyncFileLog>), _defaultSession(NULL) {}
-  App(StoreFactory* storeFactory, LogFactory* logFactory) : _threaded(true), _storeFactory(storeFactory), _logFactory(logFactory), _defaultSession(NULL) {}
+  App() : _threaded(true), _externalLoop(false), _storeFactory(new StoreFactoryTmpl<AsyncFileStore>), _logFactory(new LogFactoryTmpl<AsyncFileLog>), _defaultSession(NULL), _pipeline(NULL), _reactorThreads(0), _nextReactor(0) {}
+  App(StoreFactory* storeFactory, LogFactory* logFactory) : _threaded(true), _externalLoop(false), _storeFactory(storeFactory), _logFactory(logFactory), _defaultSession(NULL), _pipeline(NULL), _reactorThreads(0), _nextReactor(0) {}
   virtual ~App();
   void setLogFactory(LogFactory* logFactory) { _logFactory = logFactory; }
   void init(cstr_t& settingsFile);
@@ -25,9 +34,34 @@ public:
   void listen();
   void startServers() { listen(); }
   void setThreaded(bool v) { _threaded = v; }
+  // do not start any I/O thread, all sessions share one reactor which the
+  // caller drives with poll()/runOnce() from its own thread
+  void setExternalLoop(bool v) { _externalLoop = v; if (v) _threaded = false; }
+  int poll(int timeoutMs = 0) { return reactor()->poll(timeoutMs); }
+  int runOnce() { return poll(0); }
+  // the reactor shared by all sessions when not threaded, user fds can be
+  // registered on it with addFd()/rmFd() to be served by the same loop
+  epoll_t* reactor();
+  epoll_t::handle_t addFd(int fd, i_poll_events* events, bool in=true, bool out=false);
+  void rmFd(epoll_t::handle_t handle) { reactor()->rm_fd(handle); }
+  // publish inbound application messages into pipeline instead of calling
+  // fromApp() on the I/O thread, which still gets them while the pipeline
+  // is not running; the pipeline is not owned by App
+  void setPipeline(Pipeline* pipeline) { _pipeline = pipeline; }
   void wait();
   void stop(bool wait=true);
   bool isLoggedOn() { return _defaultSession->isLoggedOn(); }
+  // how long the last connect() or listen() took, by phase
+  struct StartupStats
+  {
+    StartupStats() : sessions(0), setupMs(0), storesMs(0), warmUpMs(0), startMs(0) {}
+    size_t sessions;
+    double setupMs; // registering sessions and their reactors
+    double storesMs; // creating stores and logs, on InitThreads threads
+    double warmUpMs; // with WarmUp set
+    double startMs; // connecting clients or opening acceptors
+  };
+  const StartupStats& startupStats() const { return _startupStats; }
   bool resendRequested() { return _defaultSession->resendRequested(); }
 
   virtual void onLogon(Session& session) {}
@@ -36,15 +70,27 @@ public:
   virtual void fromApp(Message& msg, Session& session) {}
 
 protected:
+  void startThreads();
+  void configure();
+  epoll_t* sessionReactor();
+  void createStores(const sessions_t& sessions);
+  void warmUp(const sessions_t& sessions);
+  void reportStartup(const char* what, const char* phase, size_t n, double setupMs, double storesMs, double warmUpMs, double startMs);
+
   sessions_t _sessions;
   sessions_t _activeSessions;
   bool _threaded;
+  bool _externalLoop;
   std::vector<epoll_t*> _polls;
   std::vector<std::thread*> _threads;
   StoreFactory* _storeFactory;
   LogFactory* _logFactory;
   static Log* _defaultLog;
   Session* _defaultSession;
+  Pipeline* _pipeline;
+  StartupStats _startupStats;
+  size_t _reactorThreads; // of the first session, 0 for one per session
+  size_t _nextReactor;
   friend class Session;
 };
 
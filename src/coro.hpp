@@ -0,0 +1,292 @@
+#ifndef OUCH_CORO_HPP
+#define OUCH_CORO_HPP
+
+// Optional C++20 coroutine layer on top of Session, the library itself does
+// not depend on it. Include it from code compiled with -std=c++20.
+
+#if __cplusplus < 202002L || !__has_include(<coroutine>)
+#error "coro.hpp requires C++20 coroutines, compile with -std=c++20"
+#endif
+
+#include "session.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <time.h>
+
+namespace OUCH {
+
+/**
+ * Thread local pool for coroutine frames, grouped in 64 byte size classes.
+ * Frames freed on another thread simply migrate to that thread's lists.
+ */
+class FramePool
+{
+public:
+  static void* allocate(size_t n)
+  {
+    auto c = sizeClass(n);
+    if (c >= NUM_CLASSES) return ::operator new(n);
+    auto& head = lists()[c];
+    if (head) {
+      auto p = head;
+      head = head->next;
+      return p;
+    }
+    misses()++;
+    return ::operator new((c + 1) * GRANULARITY);
+  }
+
+  static void deallocate(void* p, size_t n)
+  {
+    auto c = sizeClass(n);
+    if (c >= NUM_CLASSES) { ::operator delete(p); return; }
+    auto b = (Block*)p;
+    b->next = lists()[c];
+    lists()[c] = b;
+  }
+
+  // number of frames which had to come from the heap on this thread
+  static size_t& misses() { static thread_local size_t n; return n; }
+
+private:
+  static const size_t GRANULARITY = 64;
+  static const size_t NUM_CLASSES = 64; // frames up to 4KB are pooled
+  struct Block { Block* next; };
+  static size_t sizeClass(size_t n) { return (n + GRANULARITY - 1) / GRANULARITY - 1; }
+  static Block** lists() { static thread_local Block* l[NUM_CLASSES]; return l; }
+};
+
+/**
+ * Return type of an order workflow. The coroutine starts eagerly and its
+ * frame is released as soon as it finishes, nobody has to hold on to it.
+ *
+ *   OrderFlow buy(OrderTracker& orders) {
+ *     auto r = co_await orders.submit(OrderMsg("ID1", 'B', 100, "MSFT", 123400));
+ *     if (r.type == AcceptedMsg::TYPE) ...
+ *   }
+ */
+struct OrderFlow
+{
+  struct promise_type
+  {
+    OrderFlow get_return_object() { return OrderFlow(); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+    static void* operator new(size_t n) { return FramePool::allocate(n); }
+    static void operator delete(void* p, size_t n) { FramePool::deallocate(p, n); }
+  };
+};
+
+// The exchange response which resumed an awaiting workflow, or ABORTED when
+// the tracker gave up on it without one.
+struct OrderResult
+{
+  static const char ABORTED = 0; // by OrderTracker::cancelAll(), data is zeroed
+
+  char type; // AcceptedMsg::TYPE, RejectedMsg::TYPE, ExecMsg::TYPE, CanceledMsg::TYPE ...
+  long latency; // nanoseconds between sending the request and receiving the response
+  char data[sizeof(ReplacedMsg)]; // the largest response
+  Message& msg() { return *(Message*)data; }
+  template<typename T> T& as() { return *(T*)data; }
+};
+
+/**
+ * Matches exchange responses to awaiting workflows by ClOrdID.
+ *
+ * Lives on a session's I/O thread: start workflows there (from onLogon(),
+ * fromApp() or through Session::post()) and forward every inbound message
+ * with dispatch() from App::fromApp(). Waiters are linked intrusively from
+ * their coroutine frames, so no allocation happens per request. Call
+ * cancelAll() from App::onLogout(), responses to requests in flight do not
+ * come back on the next connection; destroying the tracker cancels too.
+ */
+class OrderTracker : public noncopyable
+{
+public:
+  struct Awaiter;
+
+  OrderTracker(Session& session, size_t buckets = 4096)
+  : _session(session), _mask(roundUp(buckets) - 1), _buckets(new Awaiter*[_mask + 1]()), _closed(false)
+  {}
+  ~OrderTracker()
+  {
+    // workflows resumed from here can not wait on this tracker again
+    _closed = true;
+    cancelAll();
+    delete [] _buckets;
+  }
+
+  struct Awaiter
+  {
+    OrderTracker* tracker;
+    char id[14];
+    char request[sizeof(OrderMsg)]; // the largest request, sent once suspended
+    void (*sendFn)(Session&, const void*); // NULL to only wait
+    struct timespec sent;
+    std::coroutine_handle<> handle;
+    Awaiter* next;
+    OrderResult result;
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+      if (tracker->_closed) {
+        result.type = OrderResult::ABORTED;
+        return false;
+      }
+      handle = h;
+      tracker->link(this);
+      clock_gettime(CLOCK_MONOTONIC, &sent);
+      if (sendFn) sendFn(tracker->_session, request);
+      return true;
+    }
+    OrderResult await_resume() noexcept { return result; }
+  };
+
+  // send the order and resume on its first response (accepted, rejected ...)
+  Awaiter submit(const OrderMsg& order) { return request(order.id, order); }
+  Awaiter cancel(const CancelMsg& cancel) { return request(cancel.id, cancel); }
+  Awaiter replace(const ReplaceMsg& replace) { return request(replace.newid, replace); }
+  // resume on the next response for an order already sent, e.g. fills
+  Awaiter next(const char (&id)[14])
+  {
+    Awaiter a = {};
+    a.tracker = this;
+    memcpy(a.id, id, sizeof(a.id));
+    return a;
+  }
+
+  // returns true if msg resumed at least one waiter
+  bool dispatch(Message& msg)
+  {
+    auto id = clOrdId(msg);
+    if (!id) return false;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // unlink every match first, resumed workflows may wait on the same id again
+    Awaiter* matched = NULL;
+    auto pp = &_buckets[hash(id) & _mask];
+    while (*pp) {
+      auto a = *pp;
+      if (memcmp(a->id, id, sizeof(a->id))) { pp = &a->next; continue; }
+      *pp = a->next;
+      a->next = matched;
+      matched = a;
+    }
+    if (!matched) return false;
+    auto size = std::min(sizeof(OrderResult::data), messageSize(msg));
+    while (matched) {
+      auto a = matched;
+      matched = a->next; // the frame may be gone once resumed
+      a->result.type = msg.type;
+      a->result.latency = (now.tv_sec - a->sent.tv_sec) * 1000000000L + (now.tv_nsec - a->sent.tv_nsec);
+      memcpy(a->result.data, &msg, size);
+      a->handle.resume();
+    }
+    return true;
+  }
+
+  // resumes every waiter with OrderResult::ABORTED, returns how many
+  size_t cancelAll()
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // unlink all first, resumed workflows may wait again
+    Awaiter* all = NULL;
+    for (size_t i = 0; i <= _mask; ++i) {
+      while (auto a = _buckets[i]) {
+        _buckets[i] = a->next;
+        a->next = all;
+        all = a;
+      }
+    }
+    size_t n = 0;
+    while (all) {
+      auto a = all;
+      all = a->next; // the frame may be gone once resumed
+      a->result.type = OrderResult::ABORTED;
+      a->result.latency = (now.tv_sec - a->sent.tv_sec) * 1000000000L + (now.tv_nsec - a->sent.tv_nsec);
+      memset(a->result.data, 0, sizeof(a->result.data));
+      a->handle.resume();
+      ++n;
+    }
+    return n;
+  }
+
+private:
+  template<typename T>
+  Awaiter request(const char (&id)[14], const T& msg)
+  {
+    static_assert(sizeof(T) <= sizeof(Awaiter::request), "request too large");
+    Awaiter a = {};
+    a.tracker = this;
+    memcpy(a.id, id, sizeof(a.id));
+    memcpy(a.request, &msg, sizeof(T));
+    a.sendFn = [](Session& s, const void* m) { s.send(*(const T*)m); };
+    return a;
+  }
+
+  void link(Awaiter* a)
+  {
+    auto& b = _buckets[hash(a->id) & _mask];
+    a->next = b;
+    b = a;
+  }
+
+  static size_t roundUp(size_t n) { size_t m = 1; while (m < n) m <<= 1; return m; }
+
+  static uint32_t hash(const char* id)
+  {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (int i = 0; i < 14; ++i) h = (h ^ (unsigned char)id[i]) * 16777619u;
+    return h;
+  }
+
+  static const char* clOrdId(Message& msg)
+  {
+    switch (msg.type) {
+      case AcceptedMsg::TYPE: return ((AcceptedMsg&)msg).id;
+      case ReplacedMsg::TYPE: return ((ReplacedMsg&)msg).newid;
+      case CanceledMsg::TYPE: return ((CanceledMsg&)msg).id;
+      case AIQCanceledMsg::TYPE: return ((AIQCanceledMsg&)msg).id;
+      case ExecMsg::TYPE: return ((ExecMsg&)msg).id;
+      case BrokenTradeMsg::TYPE: return ((BrokenTradeMsg&)msg).id;
+      case RejectedMsg::TYPE: return ((RejectedMsg&)msg).id;
+      case CancelPendingMsg::TYPE: return ((CancelPendingMsg&)msg).id;
+      case CancelRejectMsg::TYPE: return ((CancelRejectMsg&)msg).id;
+      case PriorityMsg::TYPE: return ((PriorityMsg&)msg).id;
+      case ModifiedMsg::TYPE: return ((ModifiedMsg&)msg).id;
+    }
+    return NULL;
+  }
+
+  static size_t messageSize(Message& msg)
+  {
+    switch (msg.type) {
+      case AcceptedMsg::TYPE: return sizeof(AcceptedMsg);
+      case ReplacedMsg::TYPE: return sizeof(ReplacedMsg);
+      case CanceledMsg::TYPE: return sizeof(CanceledMsg);
+      case AIQCanceledMsg::TYPE: return sizeof(AIQCanceledMsg);
+      case ExecMsg::TYPE: return sizeof(ExecMsg);
+      case BrokenTradeMsg::TYPE: return sizeof(BrokenTradeMsg);
+      case RejectedMsg::TYPE: return sizeof(RejectedMsg);
+      case CancelPendingMsg::TYPE: return sizeof(CancelPendingMsg);
+      case CancelRejectMsg::TYPE: return sizeof(CancelRejectMsg);
+      case PriorityMsg::TYPE: return sizeof(PriorityMsg);
+      case ModifiedMsg::TYPE: return sizeof(ModifiedMsg);
+    }
+    return sizeof(Message);
+  }
+
+  Session& _session;
+  size_t _mask;
+  Awaiter** _buckets;
+  bool _closed;
+};
+
+} // namespace OUCH
+
+#endif
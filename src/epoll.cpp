@@ -1,14 +1,15 @@
 #include "epoll.hpp"
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <algorithm>
 #include <new>
 #include <cassert>
-
-#include "epoll.hpp"
 static const size_t max_io_events = 256;
 enum {retired_fd = -1};
 
@@ -21,16 +22,26 @@ enum {retired_fd = -1};
     } while (false)
 
 epoll_t::epoll_t () :
+  task_tail (&task_stub),
+  task_fd (-1),
   stopping (false)
 {
   load_ = 0;
   epoll_fd = epoll_create (1);
   assert (epoll_fd != -1);
+  task_stub.next = NULL;
+  task_head = &task_stub;
+  task_signalled = false;
+  task_events.poll = this;
 }
 
 epoll_t::~epoll_t ()
 {
   close (epoll_fd);
+  if (task_fd != -1)
+    close (task_fd);
+  for (task_node_t *node; (node = pop_task ()) != NULL;)
+    delete node;
   for (retired_t::iterator it = retired.begin (); it != retired.end (); ++it)
     delete *it;
 }
@@ -43,10 +54,6 @@ epoll_t::handle_t epoll_t::add_fd (int fd_, i_poll_events *events_)
   poll_entry_t *pe = new (std::nothrow) poll_entry_t;
   assert (pe);
 
-  //  The memset is not actually needed. It's here to prevent debugging
-  //  tools to complain about using uninitialised memory.
-  memset (pe, 0, sizeof (poll_entry_t));
-
   pe->fd = fd_;
   pe->ev.events = 0;
   pe->ev.data.ptr = pe;
@@ -67,6 +74,7 @@ void epoll_t::rm_fd (handle_t handle_)
   int rc = epoll_ctl (epoll_fd, EPOLL_CTL_DEL, pe->fd, &pe->ev);
   errno_assert (rc != -1);
   pe->fd = retired_fd;
+  retired.push_back (pe);
 
   //  Decrease the load metric of the thread.
   load_--;
@@ -104,46 +112,159 @@ void epoll_t::reset_pollout (handle_t handle_)
   errno_assert (rc != -1);
 }
 
+void epoll_t::post (task_t task_)
+{
+  //  The eventfd is created on first use so that pollers nobody posts to
+  //  (e.g. the ones behind store and log queues) do not pay for it.
+  std::call_once (task_once, [this] () {
+    task_fd = eventfd (0, EFD_NONBLOCK);
+    assert (task_fd != -1);
+    task_entry.fd = task_fd;
+    task_entry.ev.events = EPOLLIN;
+    task_entry.ev.data.ptr = &task_entry;
+    task_entry.events = &task_events;
+    int rc = epoll_ctl (epoll_fd, EPOLL_CTL_ADD, task_fd, &task_entry.ev);
+    errno_assert (rc != -1);
+  });
+
+  task_node_t *node = new task_node_t;
+  node->task.swap (task_);
+  push_task (node);
+
+  //  Only the first post after the loop drained the queue pays the syscall.
+  if (!task_signalled.exchange (true, std::memory_order_acq_rel)) {
+    uint64_t value = 1;
+    ssize_t rc = write (task_fd, &value, sizeof (value));
+    errno_assert (rc == sizeof (value));
+  }
+}
+
+void epoll_t::push_task (task_node_t *node_)
+{
+  node_->next.store (NULL, std::memory_order_relaxed);
+  task_node_t *prev = task_head.exchange (node_, std::memory_order_acq_rel);
+  prev->next.store (node_, std::memory_order_release);
+}
+
+epoll_t::task_node_t *epoll_t::pop_task ()
+{
+  task_node_t *tail = task_tail;
+  task_node_t *next = tail->next.load (std::memory_order_acquire);
+  if (tail == &task_stub) {
+    if (!next)
+      return NULL;
+    task_tail = next;
+    tail = next;
+    next = next->next.load (std::memory_order_acquire);
+  }
+  if (next) {
+    task_tail = next;
+    return tail;
+  }
+  //  A producer is between exchange and linking, pick it up next round.
+  if (tail != task_head.load (std::memory_order_acquire))
+    return NULL;
+  push_task (&task_stub);
+  next = tail->next.load (std::memory_order_acquire);
+  if (next) {
+    task_tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+void epoll_t::run_tasks ()
+{
+  uint64_t value;
+  if (read (task_fd, &value, sizeof (value))) {}
+  //  Re-arm before draining so tasks posted while running wake us again.
+  task_signalled.store (false, std::memory_order_release);
+  for (task_node_t *node; (node = pop_task ()) != NULL;) {
+    node->task ();
+    delete node;
+  }
+  //  A producer caught between exchange and linking may have seen the old
+  //  flag and skipped the wake-up; signal on its behalf.
+  if (task_head.load (std::memory_order_acquire) != task_tail &&
+        !task_signalled.exchange (true, std::memory_order_acq_rel)) {
+    uint64_t value = 1;
+    ssize_t rc = write (task_fd, &value, sizeof (value));
+    errno_assert (rc == sizeof (value));
+  }
+}
+
+void epoll_t::task_events_t::in_event (int)
+{
+  poll->run_tasks ();
+}
+
+void epoll_t::defer (handle_t handle_)
+{
+  poll_entry_t *pe = (poll_entry_t*) handle_;
+  if (pe->deferred)
+    return;
+  pe->deferred = true;
+  deferred.push_back (pe);
+}
+
 void epoll_t::stop ()
 {
   stopping = true;
 }
 
 void epoll_t::loop ()
+{
+  while (!stopping)
+    poll (100); // timeout in milliseconds
+}
+
+int epoll_t::poll (int timeout_)
 {
   epoll_event ev_buf [max_io_events];
 
-  while (!stopping) {
-    //  Wait for events.
-    int n = epoll_wait (epoll_fd, &ev_buf [0], max_io_events, 100); // timeout in milliseconds
-    if (n == -1) {
-      assert (errno == EINTR);
-      continue;
-    }
+  //  Wait for events, do not block if some work was deferred.
+  int n = epoll_wait (epoll_fd, &ev_buf [0], max_io_events,
+    deferred.empty () ? timeout_ : 0);
+  if (n == -1) {
+    assert (errno == EINTR);
+    return 0;
+  }
 
-    for (int i = 0; i < n; i ++) {
-      poll_entry_t *pe = ((poll_entry_t*) ev_buf [i].data.ptr);
+  for (int i = 0; i < n; i ++) {
+    poll_entry_t *pe = ((poll_entry_t*) ev_buf [i].data.ptr);
 
-      if (ev_buf [i].events & EPOLLOUT)
-        pe->events->out_event (pe->fd);
-      if (pe->fd == retired_fd) {
-        retired.push_back (pe);
-        continue;
-      }
-      if (ev_buf [i].events & EPOLLIN)
+    if (pe->fd == retired_fd)
+      continue;
+    if (ev_buf [i].events & EPOLLOUT)
+      pe->events->out_event (pe->fd);
+    if (pe->fd == retired_fd)
+      continue;
+    //  Deferred sources are served once, in the pass below.
+    if ((ev_buf [i].events & EPOLLIN) && !pe->deferred)
+      pe->events->in_event (pe->fd);
+  }
+
+  //  Give the sources deferred last iteration their next slice, after the
+  //  fresh events so that a busy source can not starve the others.
+  if (!deferred.empty ()) {
+    resumed.swap (deferred);
+    for (retired_t::iterator it = resumed.begin (); it != resumed.end (); ++it) {
+      poll_entry_t *pe = *it;
+      pe->deferred = false;
+      if (pe->fd != retired_fd)
         pe->events->in_event (pe->fd);
-      if (pe->fd == retired_fd) {
-        retired.push_back (pe);
-        continue;
-      }
     }
+    n += resumed.size ();
+    resumed.clear ();
+  }
 
-    //  Destroy retired event sources.
-    for (retired_t::iterator it = retired.begin (); it != retired.end ();
-        ++it) {
-       delete *it;
-    }
-    retired.clear ();
+  //  Destroy retired event sources.
+  for (retired_t::iterator it = retired.begin (); it != retired.end ();
+      ++it) {
+    if ((*it)->deferred)
+      deferred.erase (std::find (deferred.begin (), deferred.end (), *it));
+    delete *it;
   }
+  retired.clear ();
+  return n;
 }
-
@@ -5,6 +5,8 @@
 
 #include <vector>
 #include <atomic>
+#include <functional>
+#include <mutex>
 #include <sys/epoll.h>
 
 struct i_poll_events
@@ -25,9 +27,11 @@ class epoll_t
   public:
     struct poll_entry_t
     {
+      poll_entry_t () : fd (-1), ev (), events (NULL), deferred (false) {}
       int fd;
       epoll_event ev;
       i_poll_events *events;
+      bool deferred;
     };
     typedef poll_entry_t* handle_t;
 
@@ -41,12 +45,50 @@ class epoll_t
     void reset_pollin (handle_t handle_);
     void set_pollout (handle_t handle_);
     void reset_pollout (handle_t handle_);
+    //  Call in_event again in the next iteration even if the fd is not
+    //  readable, for sources which stopped early to let others run. Only
+    //  from the thread driving the loop.
+    void defer (handle_t handle_);
     void stop ();
     //  Main event loop.
     void loop ();
+    //  Run a single iteration of the loop, waiting at most timeout_ ms
+    //  (0 returns immediately). Returns the number of events dispatched.
+    int poll (int timeout_ = 0);
     int load() { return load_; }
 
+    //  "executor" concept. Queue a task to run on the thread driving loop ().
+    //  Safe to call from any thread. The first post sets up the eventfd under
+    //  a once flag, later ones are lock-free; wake-ups are coalesced so a
+    //  burst of posts costs a single eventfd write per loop iteration.
+    typedef std::function<void ()> task_t;
+    void post (task_t task_);
+
   private:
+    //  Intrusive MPSC node queue (Vyukov), producers never block.
+    struct task_node_t
+    {
+      task_t task;
+      std::atomic<task_node_t*> next;
+    };
+    struct task_events_t : public i_poll_events
+    {
+      epoll_t *poll;
+      void in_event (int);
+    };
+    void push_task (task_node_t *node_);
+    task_node_t *pop_task ();
+    void run_tasks ();
+
+    std::atomic<task_node_t*> task_head;
+    task_node_t *task_tail;
+    task_node_t task_stub;
+    std::atomic<bool> task_signalled;
+    int task_fd;
+    std::once_flag task_once;
+    poll_entry_t task_entry;
+    task_events_t task_events;
+
     //  Main epoll file descriptor
     int epoll_fd;
     std::atomic<int> load_;
@@ -55,6 +97,11 @@ class epoll_t
     typedef std::vector <poll_entry_t*> retired_t;
     retired_t retired;
 
+    //  Event sources to be served again next iteration, and the ones being
+    //  served in this iteration.
+    retired_t deferred;
+    retired_t resumed;
+
     //  If true, thread is in the process of shutting down.
     bool stopping;
 
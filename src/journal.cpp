@@ -0,0 +1,643 @@
+#include "journal.hpp"
+
+#include "session.hpp"
+#include "ouch.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace OUCH;
+
+static const char JOURNAL_MAGIC[8] = {'O', 'U', 'C', 'H', 'J', 'N', 'L', '1'};
+static const char JOURNAL_SEQNUMS_MAGIC[8] = {'O', 'U', 'C', 'H', 'J', 'S', 'Q', '1'};
+static const size_t JOURNAL_HEADER_SIZE = 16;
+static const size_t JOURNAL_SEQNUMS_PAGE_SIZE = 4096;
+static const uint64_t JOURNAL_PAGE_SIZE = 4096; // segments start on these
+static const uint32_t JOURNAL_MAX_RECORD = 1 << 24;
+static const uint64_t JOURNAL_MIN_MAP = 1 << 20; // of a segment, when first read
+// the crc covers the record header from the session field on
+static const size_t RECORD_CRC_OFFSET = offsetof(Journal::Record, session);
+
+typedef std::map<str_t, std::weak_ptr<Journal>> journals_t;
+static journals_t journals;
+static std::mutex journalsMutex;
+static str_t journalPath;
+
+static int64_t nowNanos()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int setting(const Session* s, cstr_t& key, int defaultValue)
+{
+  return s ? s->get(key, defaultValue) : defaultValue;
+}
+
+// for sizes that do not fit an int
+static uint64_t setting(const Session* s, cstr_t& key, uint64_t defaultValue)
+{
+  if (!s || s->get(key).empty()) return defaultValue;
+  return strtoull(s->get(key).c_str(), NULL, 10);
+}
+
+static uint64_t pageAlign(uint64_t n)
+{
+  return (n + JOURNAL_PAGE_SIZE - 1) & ~(JOURNAL_PAGE_SIZE - 1);
+}
+
+static uint32_t recordCrc(const Journal::Record& r, const void* data)
+{
+  auto crc = crc32c(0, (const char*)&r + RECORD_CRC_OFFSET, sizeof(r) - RECORD_CRC_OFFSET);
+  return crc32c(crc, data, r.len);
+}
+
+static std::shared_ptr<Journal> lookup(cstr_t& file, std::function<Journal*()> create)
+{
+  std::lock_guard<std::mutex> l(journalsMutex);
+  auto& p = journals[file];
+  auto j = p.lock();
+  if (!j) {
+    j.reset(create());
+    p = j;
+  }
+  return j;
+}
+
+std::shared_ptr<Journal> Journal::open(const Session& s)
+{
+  auto setting = s.get("JournalPath");
+  if (setting.empty()) setting = s.get("FileStorePath");
+  auto path = mystrftime(setting);
+  if (path == setting) path = mystrftime(path + "/%Y%m%d");
+  mkdirs(path);
+  if (path.empty()) path = ".";
+  {
+    std::lock_guard<std::mutex> l(journalsMutex);
+    journalPath = path + '/';
+  }
+  auto name = s.senderCompId() + "-" + s.targetCompId();
+  if (s.get("JournalShared", 0)) name = s.get("JournalGroup").empty() ? "SHARED" : s.get("JournalGroup");
+  auto file = path + '/' + name + ".journal";
+  return lookup(file, [&]() { return new Journal(file, &s); });
+}
+
+std::shared_ptr<Journal> Journal::openGlobal()
+{
+  str_t file;
+  {
+    std::lock_guard<std::mutex> l(journalsMutex);
+    file = journalPath + "GLOBAL.journal";
+  }
+  return lookup(file, [&]() { return new Journal(file, NULL); });
+}
+
+Journal::Journal(cstr_t& path, const Session* s)
+: Queue(setting(s, "QueueChunkSize", (int)CHUNK_SIZE), setting(s, "QueueChunkPreallocate", 0)),
+  _path(path),
+  _file(setting(s, "JournalWriteBuffer", FileWriter::DEFAULT_BUFFER_SIZE),
+    (setting(s, "JournalDirectIO", 0) ? FileWriter::DIRECT : 0) | (setting(s, "IoUring", 1) ? 0 : FileWriter::NO_URING),
+    setting(s, "JournalPreallocate", 0)),
+  _segmentSize(setting(s, "JournalSegmentSize", (uint64_t)1 << 30)),
+  _end(0), _segmentBase(0), _bases(MAX_SEGMENTS), _segments(0), _writing(0), _flushed(0), _seqNumsMapped(0),
+  _users(0), _syncOnDrain(false), _unsynced(false)
+{
+  _sessions.reserve(MAX_SESSIONS);
+  openSeqNums(_path + ".seqnums");
+  scan();
+  _writing = _segments - 1;
+  _file.open(segmentPath(_writing));
+  if (_end == _segmentBase) {
+    char header[JOURNAL_HEADER_SIZE] = {};
+    memcpy(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    _file.append(header, sizeof(header));
+    _end += sizeof(header);
+  }
+  _flushed = _end;
+}
+
+Journal::~Journal()
+{
+  stop(true);
+  _file.close();
+  for (auto& m : _maps) if (m.data) munmap(m.data, m.size);
+  for (auto& m : _retired) munmap(m.data, m.size);
+  for (auto p : _sessions) delete p;
+}
+
+str_t Journal::segmentPath(size_t segment) const
+{
+  return segment ? _path + '.' + std::to_string(segment) : _path;
+}
+
+// Reads back the segments of an existing journal, rebuilding the sessions
+// and their indexes. The journal is cut after the last intact record, later
+// segments are removed.
+void Journal::scan()
+{
+  size_t segment = 0;
+  uint64_t base = 0;
+  while (true) {
+    _bases[segment] = base;
+    _segments = segment + 1;
+    _segmentBase = base;
+    bool intact = scan(segment, base);
+    if (!intact || !exists(segmentPath(segment + 1))) break;
+    if (segment + 1 == MAX_SEGMENTS) die("Too many segments in journal " + _path);
+    base = pageAlign(_end);
+    ++segment;
+  }
+  // a segment created and not written yet is dropped as well
+  for (auto i = _segments.load(); exists(segmentPath(i)); ++i) unlink(segmentPath(i).c_str());
+  if (*checkpoint() > _end) *checkpoint() = _end;
+  recoverSeqNums();
+}
+
+// a record header that could have been written, for walking records synced
+// before the checkpoint without checking their CRC
+bool Journal::plausible(const Record& r) const
+{
+  if (r.flags & ~(IN | OUT | SEQUENCED | EVENT | SESSION) || r.session > _sessions.size()) return false;
+  if (r.session == _sessions.size()) return r.flags & SESSION;
+  if (!(r.flags & SEQUENCED)) return true;
+  return r.seqnum > 0 && (size_t)r.seqnum <= _sessions[r.session]->index.size() + 1;
+}
+
+// scans one segment, false if it had to be cut
+bool Journal::scan(size_t segment, uint64_t base)
+{
+  auto path = segmentPath(segment);
+  auto fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) dieerr("Could not open journal " + path);
+  struct stat st;
+  if (fstat(fd, &st)) dieerr("Could not stat journal " + path);
+  uint64_t size = st.st_size;
+  _end = base;
+  if (size < JOURNAL_HEADER_SIZE) {
+    // not even the header made it
+    if (size && ftruncate(fd, 0)) dieerr("Could not truncate journal " + path);
+    ::close(fd);
+    return false;
+  }
+  auto p = (const char*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) dieerr("Could not map journal " + path);
+  madvise((void*)p, size, MADV_SEQUENTIAL);
+  if (memcmp(p, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC))) die("Invalid journal file: " + path);
+
+  // records synced before the last checkpoint are only walked, the rest
+  // are checked against their CRC
+  auto checkpoint = *this->checkpoint();
+  uint64_t offset = JOURNAL_HEADER_SIZE;
+  while (offset + sizeof(Record) <= size) {
+    auto r = (const Record*)(p + offset);
+    auto data = (const char*)(r + 1);
+    auto next = offset + sizeof(Record) + r->len;
+    if (r->len > JOURNAL_MAX_RECORD || next > size) break;
+    if ((base + next > checkpoint || !plausible(*r)) && r->crc != recordCrc(*r, data)) break;
+    while (_sessions.size() <= r->session) _sessions.push_back(new SessionInfo(""));
+    auto info = _sessions[r->session];
+    if (r->flags & SESSION) {
+      info->name.assign(data, r->len);
+      info->created = r->time;
+      info->index.clear();
+      info->lastIn = 0;
+    } else if (r->flags & SEQUENCED) {
+      index(r->session, r->seqnum, base + offset + sizeof(Record), r->len);
+    } else if (r->flags & IN && r->seqnum) {
+      info->lastIn = r->seqnum;
+    }
+    offset = next;
+  }
+  munmap((void*)p, size);
+  if (offset < size) {
+    if (ftruncate(fd, offset)) dieerr("Could not truncate journal " + path);
+    fprintf(stderr, "Cut %llu bytes of torn records off %s\n", (unsigned long long)(size - offset), path.c_str());
+  }
+  ::close(fd);
+  _end = base + offset;
+  return offset == size;
+}
+
+// the seqnums map reserves room for MAX_SESSIONS and grows in place, so
+// seqNums() may be read without _mi while attach() grows it
+static size_t seqNumsSize(size_t sessions)
+{
+  auto need = JOURNAL_HEADER_SIZE + sessions * sizeof(Journal::SeqNums);
+  return (need + JOURNAL_SEQNUMS_PAGE_SIZE - 1) & ~(JOURNAL_SEQNUMS_PAGE_SIZE - 1);
+}
+
+void Journal::openSeqNums(cstr_t& path)
+{
+  _seqNums.open(path, JOURNAL_SEQNUMS_PAGE_SIZE, seqNumsSize(MAX_SESSIONS));
+  auto data = _seqNums.data();
+  if (memcmp(data, JOURNAL_SEQNUMS_MAGIC, sizeof(JOURNAL_SEQNUMS_MAGIC))) {
+    memset(data, 0, _seqNums.size());
+    memcpy(data, JOURNAL_SEQNUMS_MAGIC, sizeof(JOURNAL_SEQNUMS_MAGIC));
+  }
+}
+
+// sizes the seqnums file for the sessions scanned, and has the journal win
+// over sequence numbers lost or left behind
+void Journal::recoverSeqNums()
+{
+  _seqNums.resize(seqNumsSize(_sessions.size()));
+  _seqNumsMapped.store(_seqNums.size(), std::memory_order_release);
+  for (size_t i = 0; i < _sessions.size(); ++i) {
+    auto n = seqNums(i);
+    if (n->sender < 1) n->sender = 1;
+    if (n->target < 1) n->target = _sessions[i]->lastIn + 1;
+    int next = _sessions[i]->index.empty() ? 1 : _sessions[i]->index.size();
+    if (n->sender < next) n->sender = next;
+  }
+}
+
+Journal::SeqNums* Journal::seqNums(int session) const
+{
+  return (SeqNums*)(_seqNums.data() + JOURNAL_HEADER_SIZE) + session;
+}
+
+int Journal::attach(cstr_t& name)
+{
+  std::unique_lock<std::mutex> l(_mi);
+  ++_users;
+  for (size_t i = 0; i < _sessions.size(); ++i)
+    if (_sessions[i]->name == name) return i;
+  if (_sessions.size() == MAX_SESSIONS) die("Too many sessions in journal " + _path);
+  int id = _sessions.size();
+  _seqNums.resize(seqNumsSize(id + 1));
+  _seqNumsMapped.store(_seqNums.size(), std::memory_order_release);
+  _sessions.push_back(new SessionInfo(name));
+  l.unlock();
+  reset(id);
+  return id;
+}
+
+void Journal::detach(bool wait)
+{
+  if (--_users <= 0) stop(wait);
+}
+
+void Journal::reset(int session)
+{
+  auto info = _sessions[session];
+  append(session, SESSION, 0, info->name.data(), info->name.size());
+  std::lock_guard<std::mutex> l(_mi);
+  info->index.clear();
+  info->created = nowNanos();
+  auto n = seqNums(session);
+  n->sender.store(1, std::memory_order_release);
+  n->target.store(1, std::memory_order_release);
+}
+
+UtcTimeStamp Journal::getCreationTime(int session)
+{
+  std::lock_guard<std::mutex> l(_mi);
+  auto t = _sessions[session]->created;
+  return UtcTimeStamp(t / 1000000000, t % 1000000000 / 1000000);
+}
+
+bool Journal::takeSequenced(int session)
+{
+  auto& n = _sessions[session]->sequenced;
+  auto v = n.load(std::memory_order_relaxed);
+  while (v > 0)
+    if (n.compare_exchange_weak(v, v - 1)) return true;
+  return false;
+}
+
+// Frames the record and queues it for the writer, returns the offset its
+// payload will have in the file.
+uint64_t Journal::append(int session, int flags, int seqnum, const void* data, size_t len)
+{
+  Record r;
+  r.len = len;
+  r.crc = 0; // filled in by the writer
+  r.session = session;
+  r.flags = flags;
+  r.reserved = 0;
+  r.seqnum = seqnum;
+  r.time = nowNanos();
+  uint64_t offset;
+  {
+    lock_t l(_m);
+    // the writer rolls over by the same rule, on the same sizes
+    auto size = _end - _segmentBase;
+    if (_segmentSize && size > JOURNAL_HEADER_SIZE && size + sizeof(r) + len > _segmentSize) {
+      auto segment = _segments.load(std::memory_order_relaxed);
+      if (segment == MAX_SEGMENTS) die("Too many segments in journal " + _path);
+      _segmentBase = pageAlign(_end);
+      _bases[segment] = _segmentBase;
+      _segments.store(segment + 1, std::memory_order_release);
+      _end = _segmentBase + JOURNAL_HEADER_SIZE;
+    }
+    offset = _end + sizeof(r);
+    _end = offset + len;
+    Head h(LOG, sizeof(r) + len);
+    auto t = getChunk(sizeof(h) + h.len);
+    memcpy(t->data + t->tail, &h, sizeof(h));
+    t->tail += sizeof(h);
+    memcpy(t->data + t->tail, &r, sizeof(r));
+    t->tail += sizeof(r);
+    memcpy(t->data + t->tail, data, len);
+    t->tail += len;
+    uint64_t value = 1;
+    if (::write(_fd, &value, 8)) {}
+  }
+  if (flags & SEQUENCED) {
+    std::lock_guard<std::mutex> l(_mi);
+    index(session, seqnum, offset, len);
+  }
+  return offset;
+}
+
+void Journal::index(int session, int seqnum, uint64_t offset, uint32_t len)
+{
+  auto& index = _sessions[session]->index;
+  if ((int)index.size() <= seqnum) index.resize(seqnum + 1, Entry{0, 0});
+  index[seqnum] = Entry{offset, len};
+}
+
+void Journal::get(int session, int begin, int end, msgviews_t& views)
+{
+  views.clear();
+  std::lock_guard<std::mutex> l(_mi);
+  auto& index = _sessions[session]->index;
+  if (begin < 1) begin = 1;
+  if (end >= (int)index.size()) end = (int)index.size() - 1;
+  uint64_t last = 0;
+  for (int i = begin; i <= end; ++i)
+    if (index[i].len) last = std::max(last, index[i].offset + index[i].len);
+  if (!last) return;
+  if (last > _flushed.load(std::memory_order_acquire)) barrier();
+  for (int i = begin; i <= end; ++i)
+    if (index[i].len) views.push_back(MsgView(map(index[i].offset, index[i].len), index[i].len));
+}
+
+int Journal::readable(int session)
+{
+  std::lock_guard<std::mutex> l(_mi);
+  auto& index = _sessions[session]->index;
+  auto flushed = _flushed.load(std::memory_order_acquire);
+  int n = (int)index.size() - 1;
+  while (n > 0 && index[n].offset + index[n].len > flushed) --n;
+  return std::max(n, 0);
+}
+
+void Journal::whenFlushed(std::function<void()> done)
+{
+  if (stopped()) {
+    done();
+    return;
+  }
+  auto p = new std::function<void()>(std::move(done)); // deleted by the writer
+  lock_t l(_m);
+  Head h(NOTIFY, sizeof(p));
+  auto t = getChunk(sizeof(h) + h.len);
+  memcpy(t->data + t->tail, &h, sizeof(h));
+  t->tail += sizeof(h);
+  memcpy(t->data + t->tail, &p, sizeof(p));
+  t->tail += sizeof(p);
+  uint64_t value = 1;
+  if (::write(_fd, &value, 8)) {}
+}
+
+// Address of the len bytes at offset, mapping their segment as far as needed.
+// Maps only cover what has been read, at least doubling when they grow; an
+// outgrown map is kept until the journal closes, as views may point into it.
+const char* Journal::map(uint64_t offset, uint32_t len)
+{
+  auto segments = _segments.load(std::memory_order_acquire);
+  size_t segment = std::upper_bound(_bases.begin(), _bases.begin() + segments, offset) - _bases.begin() - 1;
+  auto base = _bases[segment];
+  if (_maps.size() <= segment) _maps.resize(segment + 1, SegmentMap{NULL, 0});
+  auto& m = _maps[segment];
+  auto end = offset + len - base;
+  if (end > m.size) {
+    auto size = pageAlign(std::max(end, std::max(m.size * 2, (uint64_t)JOURNAL_MIN_MAP)));
+    auto path = segmentPath(segment);
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) dieerr("Could not open journal " + path);
+    auto p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) dieerr("Could not map journal " + path);
+    if (m.data) _retired.push_back(m);
+    m = SegmentMap{(char*)p, size};
+  }
+  return m.data + (offset - base);
+}
+
+// waits until the writer thread has handed everything queued so far to the
+// kernel, the file is only ever written from that thread
+void Journal::barrier()
+{
+  if (stopped()) return;
+  std::atomic<bool> done(false);
+  auto p = &done;
+  {
+    lock_t l(_m);
+    Head h(FLUSH, sizeof(p));
+    auto t = getChunk(sizeof(h) + h.len);
+    memcpy(t->data + t->tail, &h, sizeof(h));
+    t->tail += sizeof(h);
+    memcpy(t->data + t->tail, &p, sizeof(p));
+    t->tail += sizeof(p);
+    uint64_t value = 1;
+    if (::write(_fd, &value, 8)) {}
+  }
+  while (!done.load(std::memory_order_acquire)) std::this_thread::yield();
+}
+
+void Journal::in_event(int fd)
+{
+  uint64_t value;
+  if (!read(fd, &value, 8)) {assert(0);} // have to read because we are not using EPOLLET mode
+  getData();
+  auto _data = (char*)(_h + 1);
+  switch (_h->type) {
+    case LOG:
+      {
+        auto r = (Record*)_data;
+        auto size = _file.size();
+        if (_segmentSize && size > JOURNAL_HEADER_SIZE && size + _h->len > _segmentSize) roll();
+        r->crc = recordCrc(*r, r + 1);
+        _file.append(_data, _h->len);
+        _unsynced = true;
+      }
+      break;
+    case FLUSH:
+      _file.flush();
+      _flushed.store(_bases[_writing] + _file.size(), std::memory_order_release);
+      (*(std::atomic<bool>**)_data)->store(true, std::memory_order_release);
+      break;
+    case NOTIFY:
+      {
+        auto done = *(std::function<void()>**)_data;
+        _file.flush();
+        _flushed.store(_bases[_writing] + _file.size(), std::memory_order_release);
+        (*done)();
+        delete done;
+      }
+      break;
+    case SYNC:
+      syncData();
+      break;
+    default:
+      assert(0);
+  }
+  release();
+  if (drained()) {
+    // one write, and one sync for all sessions, per burst
+    if (_unsynced && _syncOnDrain) syncData();
+    else _file.flush();
+    _flushed.store(_bases[_writing] + _file.size(), std::memory_order_release);
+  }
+}
+
+// syncs what has been written and moves the checkpoint recovery starts from;
+// the seqnums pages go out after the data so the checkpoint never runs ahead
+void Journal::syncData()
+{
+  _file.syncData();
+  _unsynced = false;
+  *checkpoint() = _bases[_writing] + _file.size();
+  _seqNums.sync(_seqNumsMapped.load(std::memory_order_acquire));
+}
+
+// closes the segment being written and starts the next one
+void Journal::roll()
+{
+  if (_syncOnDrain) syncData();
+  _file.close();
+  auto path = segmentPath(++_writing);
+  unlink(path.c_str());
+  _file.open(path);
+  char header[JOURNAL_HEADER_SIZE] = {};
+  memcpy(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+  _file.append(header, sizeof(header));
+}
+
+// the file belongs to the queue thread, only touch it once that is gone
+void Journal::stop(bool wait)
+{
+  if (stopped()) return;
+  Queue::stop(wait);
+  // one sync on the way out spares the next start checking every record
+  syncData();
+  _flushed.store(_bases[_writing] + _file.size(), std::memory_order_release);
+}
+
+static void ntoh(Message* msg)
+{
+  switch (msg->type) {
+    case AcceptedMsg::TYPE: ((AcceptedMsg*)msg)->ntoh(); break;
+    case ReplacedMsg::TYPE: ((ReplacedMsg*)msg)->ntoh(); break;
+    case CanceledMsg::TYPE: ((CanceledMsg*)msg)->ntoh(); break;
+    case AIQCanceledMsg::TYPE: ((AIQCanceledMsg*)msg)->ntoh(); break;
+    case ExecMsg::TYPE: ((ExecMsg*)msg)->ntoh(); break;
+    case BrokenTradeMsg::TYPE: ((BrokenTradeMsg*)msg)->ntoh(); break;
+    case RejectedMsg::TYPE: ((RejectedMsg*)msg)->ntoh(); break;
+    case CancelPendingMsg::TYPE: ((CancelPendingMsg*)msg)->ntoh(); break;
+    case CancelRejectMsg::TYPE: ((CancelRejectMsg*)msg)->ntoh(); break;
+    case PriorityMsg::TYPE: ((PriorityMsg*)msg)->ntoh(); break;
+    case ModifiedMsg::TYPE: ((ModifiedMsg*)msg)->ntoh(); break;
+    case SysMsg::TYPE: ((SysMsg*)msg)->ntoh(); break;
+  }
+}
+
+void Journal::render(cstr_t& path, std::ostream& out)
+{
+  std::vector<str_t> names;
+  std::vector<char> buf;
+  for (size_t segment = 0; ; ++segment) {
+    auto file = segment ? path + '.' + std::to_string(segment) : path;
+    std::ifstream in(file.c_str(), std::ios::binary);
+    if (segment && !in.is_open()) break;
+    char header[JOURNAL_HEADER_SIZE];
+    if (!in.read(header, sizeof(header)) || memcmp(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)))
+      die("Invalid journal file: " + file);
+    Record r;
+    while (in.read((char*)&r, sizeof(r))) {
+      if (r.len > JOURNAL_MAX_RECORD) break;
+      buf.resize(r.len + 1);
+      if (!in.read(buf.data(), r.len) || r.crc != recordCrc(r, buf.data())) break;
+      buf[r.len] = 0;
+      if (names.size() <= r.session) names.resize(r.session + 1);
+      if (r.flags & SESSION) names[r.session].assign(buf.data(), r.len);
+
+      struct tm tm;
+      time_t sec = r.time / 1000000000;
+      gmtime_r(&sec, &tm);
+      char t[64];
+      strftime(t, sizeof(t), "%Y%m%d-%H:%M:%S", &tm);
+      char ms[8];
+      snprintf(ms, sizeof(ms), ".%03d", (int)(r.time % 1000000000 / 1000000));
+      out << t << ms << ' ' << names[r.session] << ' ';
+
+      if (r.flags & SESSION) {
+        out << "evt Session started\n";
+      } else if (r.flags & EVENT) {
+        out << "evt " << buf.data() << '\n';
+      } else if (r.flags & SEQUENCED) {
+        // the packet as sent, header and network byte order included
+        out << "out " << r.seqnum << " <";
+        if (r.len > 3) {
+          auto msg = (Message*)(buf.data() + 3);
+          ntoh(msg);
+          Log::write(out, msg, r.len);
+        }
+        out << ">\n";
+      } else {
+        out << (r.flags & IN ? "in " : "out ");
+        if (r.seqnum) out << r.seqnum << ' ';
+        out << '<';
+        Log::write(out, buf.data(), r.flags & IN ? r.len + 3 : r.len);
+        out << ">\n";
+      }
+    }
+  }
+}
+
+JournalStore::JournalStore(const Session& s)
+: _journal(Journal::open(s)), _id(_journal->attach(s.senderCompId() + "-" + s.targetCompId()))
+{
+  _journal->setStored(_id);
+  auto durability = toLower(s.get("StoreDurability"));
+  if (durability == "group") _journal->syncOnDrain();
+  else if (!durability.empty() && durability != "none" && durability != "pagecache")
+    die("Unknown StoreDurability " + durability);
+}
+
+bool JournalStore::set(const void* data, size_t len)
+{
+  _journal->append(_id, Journal::OUT | Journal::SEQUENCED, getNextSenderMsgSeqNum(), data, len);
+  _journal->markSequenced(_id);
+  return true;
+}
+
+void JournalStore::get(int begin, int end, msgviews_t& result) const
+{
+  _journal->get(_id, begin, end, result);
+}
+
+void JournalStore::get(int begin, int end, strvec_t& result) const
+{
+  msgviews_t views;
+  get(begin, end, views);
+  result.clear();
+  for (auto& v : views) result.push_back(str_t(v.data, v.len));
+}
+
+JournalLog::JournalLog(const Session& s)
+: _journal(Journal::open(s)), _id(_journal->attach(s.senderCompId() + "-" + s.targetCompId())),
+  _sequencedIn(s.isClient())
+{
+  _journal->setLogged(_id);
+}
+
+JournalLog::JournalLog()
+: _journal(Journal::openGlobal()), _id(_journal->attach("GLOBAL")), _sequencedIn(false)
+{
+  _journal->setLogged(_id);
+}
@@ -0,0 +1,254 @@
+#ifndef OUCH_JOURNAL_HPP
+#define OUCH_JOURNAL_HPP
+
+#include "store.hpp"
+#include "log.hpp"
+
+#include <memory>
+
+namespace OUCH {
+
+/**
+ * Append only binary journal of everything sessions persist: inbound and
+ * outbound packets and events, each record stamped with its time, direction
+ * and session id. Sequenced outbound records double as the message store,
+ * an index per session over them serves resends, and the text log is
+ * rendered from the journal on demand instead of being written as it
+ * happens.
+ *
+ * By default each session has a journal of its own. With JournalShared all
+ * sessions naming the same JournalGroup append to one journal, written by
+ * one thread, so that they hold two open files between them and a group
+ * commit covers all of them with a single sync.
+ *
+ * The formats of the files are:
+ *   [path]/[SenderCompID]-[TargetCompID].journal[.N]
+ *   [path]/[SenderCompID]-[TargetCompID].journal.seqnums
+ * or shared:
+ *   [path]/[JournalGroup].journal[.N]
+ *   [path]/[JournalGroup].journal.seqnums
+ *
+ * The journal is split into segments of about JournalSegmentSize bytes, the
+ * first one without a suffix. A segment is a 16 byte file header followed
+ * by records, a Record header and its payload. Every session in the
+ * journal starts with a SESSION record holding its name, which also marks
+ * a reset. Outbound sequenced payloads are whole soupbin3 packets as sent,
+ * inbound ones the message in host byte order. Sequenced inbound records
+ * carry their sequence number when the session's store is a JournalStore,
+ * which rebuilds the next target one from them if the seqnums file is
+ * lost; otherwise, and for unsequenced ones, it is 0. The seqnums file is a
+ * mapped page of sequence numbers, one slot per session id.
+ *
+ * Offsets are logical, every segment starts on a page boundary after the
+ * end of the previous one. Resends are served from maps of the segments,
+ * which only cover what has been read.
+ *
+ * Records are framed and written by one background thread, which flushes
+ * when its queue drains, and syncs too if a session asked for
+ * StoreDurability=group. A torn tail left by a crash is cut off when the
+ * journal is opened. Only records written after the checkpoint, the end
+ * of the journal at the last sync kept in the seqnums header and synced
+ * right after the data it covers, have their CRC checked then; the writer
+ * syncs when it stops.
+ *
+ * Settings, of the first session opening the journal: JournalPath
+ * (FileStorePath by default), JournalShared, JournalGroup (SHARED by
+ * default), JournalSegmentSize (bytes, 1GB by default, 0 for one file),
+ * JournalWriteBuffer (bytes, 64KB by default), JournalDirectIO,
+ * JournalPreallocate (bytes), IoUring (0 to use pwrite), QueueChunkSize and
+ * QueueChunkPreallocate.
+ */
+class Journal : public Queue, public noncopyable
+{
+public:
+  enum Flags { IN = 1, OUT = 2, SEQUENCED = 4, EVENT = 8, SESSION = 16 };
+
+  struct Record
+  {
+    uint32_t len; // of the payload following this header
+    uint32_t crc; // CRC-32C of the rest of the header and the payload
+    uint16_t session;
+    uint8_t flags;
+    uint8_t reserved;
+    int32_t seqnum; // sequenced records, see above
+    int64_t time; // nanoseconds since the epoch
+  };
+
+  struct SeqNums
+  {
+    std::atomic<int32_t> sender;
+    std::atomic<int32_t> target;
+  };
+
+  // the journal the session's settings point to, shared by its store and log
+  static std::shared_ptr<Journal> open(const Session& s);
+  // the journal of App's default log, next to the last one opened
+  static std::shared_ptr<Journal> openGlobal();
+  ~Journal();
+
+  // id of the named session, which is started in the journal if new; every
+  // attach is paired with a detach, the last one stops the writer
+  int attach(cstr_t& name);
+  void detach(bool wait);
+  void reset(int session);
+  // have the writer sync whenever its queue drains
+  void syncOnDrain() { _syncOnDrain = true; }
+
+  uint64_t append(int session, int flags, int seqnum, const void* data, size_t len);
+  void get(int session, int begin, int end, msgviews_t& views);
+  // sequence number get() serves up to without waiting for the writer, and
+  // done called from the writer thread once it has written all queued
+  int readable(int session);
+  void whenFlushed(std::function<void()> done);
+  SeqNums* seqNums(int session) const;
+  UtcTimeStamp getCreationTime(int session);
+
+  // counts outbound messages just stored, so that the log can skip them
+  void markSequenced(int session) { if (_sessions[session]->logged) _sessions[session]->sequenced++; }
+  bool takeSequenced(int session);
+  void setLogged(int session) { _sessions[session]->logged = true; }
+  void setStored(int session) { _sessions[session]->stored = true; }
+  // of the message being received, 0 if no JournalStore counts them
+  int inboundSeqNum(int session) const
+  { return _sessions[session]->stored ? seqNums(session)->target.load(std::memory_order_acquire) : 0; }
+
+  void in_event(int fd);
+  void stop(bool wait);
+
+  // writes a journal as text, like FileLog would have
+  static void render(cstr_t& path, std::ostream& out);
+
+private:
+  bool warmUpThread(bool lock) { return _file.warmUp(lock); }
+
+  struct Entry
+  {
+    uint64_t offset; // of the payload
+    uint32_t len;
+  };
+  struct SessionInfo
+  {
+    SessionInfo(cstr_t& name) : name(name), created(0), lastIn(0), logged(false), stored(false), sequenced(0) {}
+    str_t name;
+    int64_t created;
+    std::vector<Entry> index; // by sequence number
+    int lastIn; // sequence number of the last inbound record scanned
+    bool logged; // a JournalLog writes for this session
+    bool stored; // a JournalStore keeps its sequence numbers
+    std::atomic<int> sequenced;
+  };
+  static const size_t MAX_SESSIONS = 1 << 16;
+  static const size_t MAX_SEGMENTS = 1 << 16;
+
+  Journal(cstr_t& path, const Session* s);
+  str_t segmentPath(size_t segment) const;
+  void scan();
+  bool scan(size_t segment, uint64_t base);
+  bool plausible(const Record& r) const;
+  void roll();
+  void openSeqNums(cstr_t& path);
+  void recoverSeqNums();
+  uint64_t* checkpoint() const { return (uint64_t*)(_seqNums.data() + 8); } // after the magic
+  void syncData();
+  const char* map(uint64_t offset, uint32_t len);
+  void barrier();
+  void index(int session, int seqnum, uint64_t offset, uint32_t len);
+
+  str_t _path;
+  FileWriter _file;
+  uint64_t _segmentSize;
+  uint64_t _end; // where the next record goes, advanced when queued
+  uint64_t _segmentBase; // of the segment the next record goes to
+  std::vector<uint64_t> _bases; // of the segments, sized up front
+  std::atomic<size_t> _segments;
+  size_t _writing; // segment open for writing, the writer's own
+  std::atomic<uint64_t> _flushed; // everything before it is in the file
+  MappedFile _seqNums;
+  std::atomic<size_t> _seqNumsMapped; // bytes, what the writer syncs without taking _mi
+  // ids are indexes, capacity is reserved so that lookups need no lock;
+  // sessions attach before they have traffic
+  std::vector<SessionInfo*> _sessions;
+  std::mutex _mi; // for attaching sessions and their indexes
+  struct SegmentMap
+  {
+    char* data;
+    uint64_t size;
+  };
+  std::vector<SegmentMap> _maps; // read only, of the segments resends were served from
+  std::vector<SegmentMap> _retired; // outgrown
+  std::atomic<int> _users;
+  std::atomic<bool> _syncOnDrain;
+  bool _unsynced;
+};
+
+/**
+ * MessageStore kept in a Journal. Sequenced messages are journaled once,
+ * resends are served from the journal's index in place. StoreDurability
+ * is none, pagecache or group, group having the journal sync whenever it
+ * has written all queued records.
+ */
+class JournalStore : public MessageStore
+{
+public:
+  JournalStore(const Session& s);
+
+  bool set(const void* data, size_t len);
+  void get(int, int, strvec_t&) const;
+  void get(int, int, msgviews_t&) const;
+  int readable() const { return _journal->readable(_id); }
+  void whenReadable(std::function<void()> done) const { _journal->whenFlushed(std::move(done)); }
+
+  int getNextSenderMsgSeqNum() const
+  { return _journal->seqNums(_id)->sender.load(std::memory_order_acquire); }
+  int getNextTargetMsgSeqNum() const
+  { return _journal->seqNums(_id)->target.load(std::memory_order_acquire); }
+  void setNextSenderMsgSeqNum(int value)
+  { _journal->seqNums(_id)->sender.store(value, std::memory_order_release); }
+  void setNextTargetMsgSeqNum(int value)
+  { _journal->seqNums(_id)->target.store(value, std::memory_order_release); }
+  void incrNextSenderMsgSeqNum()
+  { setNextSenderMsgSeqNum(getNextSenderMsgSeqNum() + 1); }
+  void incrNextTargetMsgSeqNum()
+  { setNextTargetMsgSeqNum(getNextTargetMsgSeqNum() + 1); }
+
+  UtcTimeStamp getCreationTime() const
+  { return _journal->getCreationTime(_id); }
+
+  void reset() { _journal->reset(_id); }
+  void refresh() {}
+  void stop(bool wait) { _journal->detach(wait); }
+  bool warmUp(bool lock) { return _journal->warmUp(lock); }
+
+private:
+  std::shared_ptr<Journal> _journal;
+  int _id;
+};
+
+/**
+ * Log kept in a Journal. Outbound messages already journaled by a
+ * JournalStore are not written again, use Journal::render() to read it.
+ */
+struct JournalLog : public Log
+{
+  JournalLog(const Session& s);
+  JournalLog();
+
+  // len counts the packet header; only clients receive sequenced data
+  void onIncoming(const void* msg, size_t len)
+  { _journal->append(_id, Journal::IN, _sequencedIn ? _journal->inboundSeqNum(_id) : 0, msg, len - 3); }
+  void onOutgoing(const void* msg, size_t len)
+  { if (!_journal->takeSequenced(_id)) _journal->append(_id, Journal::OUT, 0, msg, len); }
+  void onEvent(const char* msg)
+  { _journal->append(_id, Journal::EVENT, 0, msg, strlen(msg)); }
+  void stop(bool wait) { _journal->detach(wait); }
+  bool warmUp(bool lock) { return _journal->warmUp(lock); }
+
+private:
+  std::shared_ptr<Journal> _journal;
+  int _id;
+  bool _sequencedIn;
+};
+
+} // namespace OUCH
+
+#endif
@@ -6,35 +6,69 @@
 using namespace OUCH;
 
 static std::string fileLogPath;
+static std::mutex fileLogPathMutex; // sessions are created in parallel
 
-FileLog::FileLog(const Session& s)
+FileLog::FileLog(const Session& s, bool open)
 {
   auto path = mystrftime(s.get("FileLogPath"));
   if (path == s.get("FileLogPath")) path = mystrftime(path + "/%Y%m%d");
   mkdirs(path);
   if (path.empty()) path = ".";
-  if (fileLogPath.empty()) fileLogPath = path + '/';
+  {
+    std::lock_guard<std::mutex> l(fileLogPathMutex);
+    if (fileLogPath.empty()) fileLogPath = path + '/';
+  }
   auto sessionid = s.senderCompId() + "-" + s.targetCompId();
   auto prefix = path + '/' + sessionid + ".";
 
-  auto fn = prefix + "messages.current.log";
-  _messages.open(fn.c_str(), std::ios::out | std::ios::app);
-  if (!_messages.is_open()) die("Could not open messages file: " + fn);
-  fn = prefix + "events.current.log";
-  _events.open(fn.c_str(), std::ios::out | std::ios::app);
-  if (!_events.is_open()) die("Could not open events file: " + fn);
+  _messagesFileName = prefix + "messages.current.log";
+  _eventsFileName = prefix + "events.current.log";
+  if (open) this->open();
+}
+
+FileLog::FileLog(bool open)
+{
+  std::string prefix;
+  {
+    std::lock_guard<std::mutex> l(fileLogPathMutex);
+    prefix = fileLogPath + "GLOBAL.";
+  }
+
+  _messagesFileName = prefix + "messages.current.log";
+  _eventsFileName = prefix + "events.current.log";
+  if (open) this->open();
+}
+
+void FileLog::open()
+{
+  _messages.open(_messagesFileName.c_str(), std::ios::out | std::ios::app);
+  if (!_messages.is_open()) die("Could not open messages file: " + _messagesFileName);
+  _events.open(_eventsFileName.c_str(), std::ios::out | std::ios::app);
+  if (!_events.is_open()) die("Could not open events file: " + _eventsFileName);
+}
+
+AsyncFileLog::AsyncFileLog(const Session& s)
+: FileLog(s, false),
+  Queue(s.get("QueueChunkSize", (int)CHUNK_SIZE), s.get("QueueChunkPreallocate", 0)),
+  _messagesFile(s.get("FileLogWriteBuffer", FileWriter::DEFAULT_BUFFER_SIZE),
+    (s.get("FileLogDirectIO", 0) ? FileWriter::DIRECT : 0) | (s.get("IoUring", 1) ? 0 : FileWriter::NO_URING),
+    s.get("FileLogPreallocate", 0)),
+  _eventsFile(64 << 10, s.get("IoUring", 1) ? 0 : FileWriter::NO_URING),
+  _messagesOut(&_messagesFile), _eventsOut(&_eventsFile)
+{
+  openWriters();
 }
 
-FileLog::FileLog()
+AsyncFileLog::AsyncFileLog()
+: FileLog(false), _eventsFile(64 << 10), _messagesOut(&_messagesFile), _eventsOut(&_eventsFile)
 {
-  auto prefix = fileLogPath + "GLOBAL.";
+  openWriters();
+}
 
-  auto fn = prefix + "messages.current.log";
-  _messages.open(fn.c_str(), std::ios::out | std::ios::app);
-  if (!_messages.is_open()) die("Could not open messages file: " + fn);
-  fn = prefix + "events.current.log";
-  _events.open(fn.c_str(), std::ios::out | std::ios::app);
-  if (!_events.is_open()) die("Could not open events file: " + fn);
+void AsyncFileLog::openWriters()
+{
+  _messagesFile.open(_messagesFileName);
+  _eventsFile.open(_eventsFileName);
 }
 
 void AsyncFileLog::in_event(int fd)
@@ -45,19 +79,31 @@ void AsyncFileLog::in_event(int fd)
   auto _data = (char*)(_h + 1);
   switch (_h->type) {
     case LOG:
-      _messages << nowUtcStr() << " : ";
-      write(_messages, _data, _h->len);
-      _messages << std::endl;
+      _messagesOut << nowUtcStr() << " : ";
+      write(_messagesOut, _data, _h->len);
+      _messagesOut << '\n';
       break;
     case EVENT:
-      _events << nowUtcStr() << " : ";
-      _events.write(_data, _h->len);
-      _events << std::endl;
+      _eventsOut << nowUtcStr() << " : ";
+      _eventsOut.write(_data, _h->len);
+      _eventsOut << '\n';
       break;
     default:
       assert(0);
   }
   release();
+  if (drained()) {
+    _messagesFile.flush();
+    _eventsFile.flush();
+  }
+}
+
+// the writers belong to the queue thread, only touch them once it is gone
+void AsyncFileLog::stop(bool wait)
+{
+  Queue::stop(wait);
+  _messagesFile.flush();
+  _eventsFile.flush();
 }
 
 void 
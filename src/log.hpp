@@ -2,6 +2,7 @@
 #define OUCH_LOG_HPP
 
 #include "util.hpp"
+#include "writer.hpp"
 
 namespace OUCH {
 
@@ -13,8 +14,11 @@ struct Log
   virtual void onOutgoing(const void* msg, size_t len) = 0;
   virtual void onEvent(const char* msg) = 0;
   virtual void stop(bool wait) {}
+  // readies buffers before the first message, see App's WarmUp; false if
+  // they were to be pinned and could not be
+  virtual bool warmUp(bool lock) { return true; }
 
-  void write(std::ostream& out, const void* msg, size_t len);
+  static void write(std::ostream& out, const void* msg, size_t len);
 };
 
 struct NullLog : public Log
@@ -65,8 +69,8 @@ struct ScreenLog : public Log
 
 struct FileLog : public Log
 {
-  FileLog(const Session& s);
-  FileLog();
+  FileLog(const Session& s) : FileLog(s, true) {}
+  FileLog() : FileLog(true) {}
   void onIncoming(const void* msg, size_t len)
   {
     write(_messages, msg, len);
@@ -83,14 +87,28 @@ struct FileLog : public Log
   }
 
 protected:
+  FileLog(const Session& s, bool open);
+  FileLog(bool open);
+  void open();
+
+  std::string _messagesFileName;
+  std::string _eventsFileName;
   std::ofstream _messages;
   std::ofstream _events;
 };
 
+/**
+ * FileLog written from a background thread through batching FileWriters,
+ * a write reaches the kernel when a buffer fills or the queue drains.
+ *
+ * Settings: FileLogWriteBuffer (bytes, 64KB by default), FileLogDirectIO,
+ * FileLogPreallocate (bytes), IoUring (0 to use pwrite), and QueueChunkSize
+ * (bytes, 1MB by default) and QueueChunkPreallocate (chunks) for the queue.
+ */
 struct AsyncFileLog: public FileLog, public Queue
 {
-  AsyncFileLog(const Session& s) : FileLog(s) {}
-  AsyncFileLog() {}
+  AsyncFileLog(const Session& s);
+  AsyncFileLog();
   void onIncoming(const void* msg, size_t len)
   {
     lock_t l(_m);
@@ -129,7 +147,17 @@ struct AsyncFileLog: public FileLog, public Queue
     if (::write(_fd, &value, 8)) {}
   }
   void in_event(int fd);
-  void stop(bool wait) { Queue::stop(wait); }
+  void stop(bool wait);
+  bool warmUp(bool lock) { return Queue::warmUp(lock); }
+
+private:
+  bool warmUpThread(bool lock) { return _messagesFile.warmUp(lock) & _eventsFile.warmUp(lock); }
+  void openWriters();
+
+  FileWriter _messagesFile;
+  FileWriter _eventsFile;
+  std::ostream _messagesOut;
+  std::ostream _eventsOut;
 };
 
 } // OUCH
@@ -577,6 +577,12 @@ struct ExecMsg : public Message
   char liquidity;
   uint64_t matchNum; // buy side and sell side share the same match number
 
+  ExecMsg(const OrderMsg& o, int execShares, int execPx, uint64_t matchNum, char liquidity=' ')
+    : Message(TYPE), tm(0), execShares(execShares), execPx(execPx), liquidity(liquidity), matchNum(matchNum)
+  {
+    memcpy(id, o.id, sizeof id);
+  }
+
   void write(std::ostream& out)
   {
     out << "35=" << "8" << '\1';
@@ -602,6 +608,14 @@ struct ExecMsg : public Message
     execPx = ntohl(execPx);
     matchNum = ntohll(matchNum);
   }
+
+  void hton()
+  {
+    tm = htonll(tm);
+    execShares = htonl(execShares);
+    execPx = htonl(execPx);
+    matchNum = htonll(matchNum);
+  }
 } packed;
 static_assert(sizeof(ExecMsg)==40, "sizeof(ExecMsg)!=40");
 
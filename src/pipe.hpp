@@ -1,28 +1,199 @@
 #ifndef PIPE_HPP
 #define PIPE_HPP
 #include <atomic>
+#include <map>
+#include <mutex>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 
 namespace MYPIPE {
 
+/**
+ * Where the memory of chunks and receive rings comes from. The default is
+ * malloc for chunks and plain pages for rings; set() swaps in another for
+ * the whole process, e.g. OUCH::HugePageAllocator. Buffers remember the
+ * allocator they came from, so it can be set at any time, but only
+ * buffers taken afterwards use it.
+ */
+struct Allocator
+{
+  virtual ~Allocator() {}
+  virtual void* allocate(size_t n) { return malloc(n); }
+  virtual void deallocate(void* p, size_t n) { free(p); }
+  // receive rings: n bytes mapped twice back to back, n rounded up by
+  // ringSize() first, see OUCH::mapMirrored()
+  virtual size_t ringSize(size_t n) { return n; }
+  virtual char* mapRing(size_t n);
+  virtual void unmapRing(char* p, size_t n);
+
+  static Allocator* get() { return current().load(std::memory_order_acquire); }
+  static void set(Allocator* a) { current().store(a ? a : byDefault(), std::memory_order_release); } // NULL for the default
+
+private:
+  static Allocator* byDefault() { static Allocator a; return &a; }
+  static std::atomic<Allocator*>& current() { static std::atomic<Allocator*> a(byDefault()); return a; }
+};
+
 static const unsigned CHUNK_SIZE = 1024 * 1024;
 struct Chunk
 {
   // atomic initialization is not atomic
-  Chunk(unsigned n=CHUNK_SIZE) : head(0), tail(0), capacity(std::max(n, CHUNK_SIZE)), data((char*)malloc(capacity)), next(NULL) {} 
+  Chunk(unsigned n=CHUNK_SIZE, unsigned min=CHUNK_SIZE) : head(0), tail(0), capacity(std::max(n, min)), allocator(Allocator::get()), data((char*)allocator->allocate(capacity)), next(NULL) {} 
+  ~Chunk() { allocator->deallocate(data, capacity); }
   void reset() { head = 0; tail.store(0, std::memory_order_relaxed); next = NULL; }
-  void resize(unsigned n) { capacity = n; free(data); data = (char*)malloc(n); }
+  void resize(unsigned n) { allocator->deallocate(data, capacity); capacity = n; data = (char*)allocator->allocate(n); }
   uint32_t head;
   std::atomic<uint32_t> tail; // because gcc<4.6 does not support std::atomic_thread_fence, so we use atomic for std fence support
   uint32_t capacity;
+  Allocator* allocator;
   char* data;
   Chunk* next;
 };
 
+/**
+ * Process wide free list of the chunks of one size, for the pipes and
+ * queues of all threads, so that a producer taking chunks and a consumer
+ * giving them back do not go through the allocator once warm. It is a
+ * lock free stack, the top pointer tagged in its unused upper 16 bits so
+ * that a chunk popped and pushed back between another thread's load and
+ * compare-exchange is not mistaken for an unchanged top. Pooled chunks
+ * are never freed, which also makes reading the next link of a top just
+ * taken by another thread safe.
+ *
+ * Chunks bigger than the pool's size, for records that do not fit one,
+ * are allocated on demand and freed when given back. Every allocation is
+ * counted as a miss.
+ */
+template <typename T>
+class ChunkPool
+{
+public:
+  static ChunkPool& instance(unsigned size)
+  {
+    auto& r = registry();
+    std::lock_guard<std::mutex> l(r.m);
+    auto& p = r.pools[size];
+    if (!p) p = new ChunkPool(size);
+    return *p;
+  }
+
+  // f(pool) for the pools of every size so far
+  template <typename F>
+  static void forEachPool(F f)
+  {
+    auto& r = registry();
+    std::lock_guard<std::mutex> l(r.m);
+    for (auto it = r.pools.begin(); it != r.pools.end(); ++it) f(*it->second);
+  }
+
+  // f(chunk) for every pooled chunk; they are taken out meanwhile, which
+  // makes others allocate, so it is for quiet times like a warm-up
+  template <typename F>
+  void forEach(F f)
+  {
+    T* taken = NULL;
+    for (T* c; (c = pop());) {
+      c->next = taken;
+      taken = c;
+    }
+    for (auto c = taken; c; c = c->next) f(*c);
+    while (taken) {
+      auto next = taken->next;
+      put(taken);
+      taken = next;
+    }
+  }
+
+  // an empty chunk with room for n bytes at least
+  T* get(size_t n=0)
+  {
+    if (n > size_) {
+      misses_.fetch_add(1, std::memory_order_relaxed);
+      return new T(n, n);
+    }
+    if (auto c = pop()) {
+      c->reset();
+      return c;
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    allocated_.fetch_add(1, std::memory_order_relaxed);
+    return new T(size_, size_);
+  }
+
+  void put(T* c)
+  {
+    if (c->capacity != size_) {
+      delete c;
+      return;
+    }
+    auto top = top_.load(std::memory_order_relaxed);
+    do {
+      c->next = (T*)(top & PTR_MASK);
+    } while (!top_.compare_exchange_weak(top, tag(top) | (uint64_t)c,
+          std::memory_order_release, std::memory_order_relaxed));
+    available_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // allocates up front until n chunks of this size exist, pooled or in use
+  void reserve(size_t n)
+  {
+    while (allocated_.load(std::memory_order_relaxed) < n) {
+      allocated_.fetch_add(1, std::memory_order_relaxed);
+      put(new T(size_, size_));
+    }
+  }
+
+  unsigned size() const { return size_; }
+  uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+  uint64_t allocated() const { return allocated_.load(std::memory_order_relaxed); }
+  uint64_t available() const { return available_.load(std::memory_order_relaxed); }
+
+private:
+  static const uint64_t PTR_MASK = ((uint64_t)1 << 48) - 1;
+  static uint64_t tag(uint64_t top) { return (top & ~PTR_MASK) + ((uint64_t)1 << 48); }
+
+  struct Registry
+  {
+    std::mutex m;
+    std::map<unsigned, ChunkPool*> pools;
+  };
+  static Registry& registry() { static Registry r; return r; }
+
+  T* pop()
+  {
+    auto top = top_.load(std::memory_order_acquire);
+    for (;;) {
+      auto c = (T*)(top & PTR_MASK);
+      if (!c) return NULL;
+      if (top_.compare_exchange_weak(top, tag(top) | (uint64_t)c->next, 
+            std::memory_order_acquire, std::memory_order_acquire)) {
+        available_.fetch_sub(1, std::memory_order_relaxed);
+        return c;
+      }
+    }
+  }
+
+  ChunkPool(unsigned size) : size_(size), top_(0), misses_(0), allocated_(0), available_(0) {}
+
+  const unsigned size_;
+  std::atomic<uint64_t> top_;
+  std::atomic<uint64_t> misses_;
+  std::atomic<uint64_t> allocated_;
+  std::atomic<uint64_t> available_;
+};
+
 class Pipe
 {
 public:
-  Pipe() { head_ = tail_ = new Chunk; spared_ = NULL; }
-  void reset() { while (head_ != tail_) { auto p = head_->next; delete head_; head_ = p; }; head_->reset(); }
+  // chunks are chunkSize bytes, or bigger to take a longer push whole,
+  // from and back to the pool of their size
+  Pipe(unsigned chunkSize=CHUNK_SIZE, size_t preallocate=0) : pool_(ChunkPool<Chunk>::instance(chunkSize))
+  { pool_.reserve(preallocate); head_ = tail_ = pool_.get(); }
+  ~Pipe() { while (head_) { auto p = head_->next; pool_.put(head_); head_ = p; } }
+  void reset() { while (head_ != tail_) { auto p = head_->next; pool_.put(head_); head_ = p; }; head_->reset(); }
 
   void push(const char* str, size_t n)
   {
@@ -39,13 +210,7 @@ public:
       memcpy(tail_->data + tail, str, remained);
       str += remained;
       n -= remained;
-      auto t = spared_.exchange(NULL); //, std::memory_order_relaxed); // not safe with std::memory_order_relaxed
-      if (!t)
-        t = new Chunk(n*2);
-      else {
-        t->reset();
-        if (t->capacity <= n) t->resize(n*2);
-      }
+      auto t = pool_.get(n + 1); // the tail has to stay below the capacity
       if (n) {
         memcpy(t->data, str, n);
         t->tail.store(n, std::memory_order_relaxed);
@@ -58,6 +223,15 @@ public:
     }
   }
 
+  // the part of the chunk being filled that is not written yet, for the
+  // producer
+  char* room(size_t& n)
+  {
+    auto tail = tail_->tail.load(std::memory_order_relaxed);
+    n = tail_->capacity - tail;
+    return tail_->data + tail;
+  }
+
   bool data(const char*& str, size_t& n)
   {
     // auto tail = head_->tail;
@@ -77,17 +251,15 @@ public:
     if (head_->head == head_->capacity) {
       auto next = head_->next;
       assert(next);
-      auto s = spared_.exchange(head_); //,std::memory_order_relaxed);
-      if (s)
-        delete s;
+      pool_.put(head_);
       head_ = next;
     }
   }
 
 private:
+  ChunkPool<Chunk>& pool_;
   Chunk* head_;
   Chunk* tail_;
-  std::atomic<Chunk*> spared_; // zmq does this way? is using free list better?
 };
 
 }
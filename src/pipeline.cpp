@@ -0,0 +1,156 @@
+#include "pipeline.hpp"
+
+#include <time.h>
+
+using namespace OUCH;
+
+Pipeline::Pipeline(size_t capacity)
+: _stopped(false), _hasBlocking(false)
+{
+  size_t n = 1;
+  while (n < capacity) n <<= 1;
+  _mask = n - 1;
+  _slots = new Slot[n];
+  for (size_t i = 0; i < n; ++i) _slots[i].seq.store(-1, std::memory_order_relaxed);
+  _claim = 0;
+  _gate = -1;
+  _running = false;
+  _blocked = 0;
+}
+
+Pipeline::~Pipeline()
+{
+  stop();
+  for (size_t i = 0; i < _consumers.size(); ++i) delete _consumers[i];
+  delete [] _slots;
+}
+
+void Pipeline::addConsumer(handler_t handler, WaitStrategy wait)
+{
+  if (_running) die("can not add consumer to a running pipeline");
+  auto c = new Consumer;
+  c->cursor.store(_claim.load() - 1, std::memory_order_relaxed);
+  c->handler = handler;
+  c->wait = wait;
+  c->thread = NULL;
+  if (wait == BLOCK) _hasBlocking = true;
+  _consumers.push_back(c);
+}
+
+void Pipeline::start()
+{
+  if (_running) return;
+  if (_consumers.empty()) die("no consumer added to pipeline");
+  if (_stopped) die("can not restart a stopped pipeline");
+  _running = true;
+  for (size_t i = 0; i < _consumers.size(); ++i) {
+    auto c = _consumers[i];
+    c->thread = new std::thread([=](){ run(c); });
+  }
+}
+
+void Pipeline::stop()
+{
+  if (!_running.exchange(false)) return;
+  _stopped = true;
+  {
+    std::lock_guard<std::mutex> l(_mb);
+    _cv.notify_all();
+  }
+  for (size_t i = 0; i < _consumers.size(); ++i) {
+    auto c = _consumers[i];
+    c->thread->join();
+    delete c->thread;
+    c->thread = NULL;
+  }
+}
+
+int64_t Pipeline::minCursor() const
+{
+  auto n = _consumers[0]->cursor.load(std::memory_order_acquire);
+  for (size_t i = 1; i < _consumers.size(); ++i)
+    n = std::min(n, _consumers[i]->cursor.load(std::memory_order_acquire));
+  return n;
+}
+
+bool Pipeline::publish(Session* session, const struct timespec& rxtm, const void* msg, size_t len)
+{
+  // the length comes off the wire, what does not fit a slot is left to the caller
+  if (len > MAX_MESSAGE_SIZE) return false;
+  if (!_running.load(std::memory_order_acquire)) return false; // no consumers to free slots
+  auto seq = _claim.fetch_add(1, std::memory_order_relaxed);
+  auto wrap = seq - (int64_t)_mask - 1; // slot is free once every consumer is past this
+  if (wrap > _gate.load(std::memory_order_acquire)) {
+    int64_t gate;
+    while (wrap > (gate = minCursor())) {
+      if (!_running.load(std::memory_order_acquire)) return false;
+      std::this_thread::yield();
+    }
+    _gate.store(gate, std::memory_order_release);
+  }
+
+  auto& slot = _slots[seq & _mask];
+  slot.ev.session = session;
+  slot.ev.rxtm = rxtm;
+  slot.ev.len = len;
+  memcpy(slot.ev.data, msg, len);
+  slot.seq.store(seq, std::memory_order_release);
+
+  if (_hasBlocking) {
+    // pairs with the increment of _blocked in waitFor, without it the
+    // publish and the check below may be reordered and a wake-up lost
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_blocked.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> l(_mb);
+      _cv.notify_all();
+    }
+  }
+  return true;
+}
+
+bool Pipeline::waitFor(Consumer* c, int64_t seq, unsigned& spins)
+{
+  auto& slot = _slots[seq & _mask];
+  while (slot.seq.load(std::memory_order_acquire) != seq) {
+    if (!_running.load(std::memory_order_relaxed)) return false;
+    switch (c->wait) {
+      case BUSY_SPIN:
+        break;
+      case YIELD:
+        if (++spins > 100) std::this_thread::yield();
+        break;
+      case SLEEP:
+        if (++spins > 200) {
+          struct timespec ts = {0, 50000};
+          nanosleep(&ts, NULL);
+        } else if (spins > 100)
+          std::this_thread::yield();
+        break;
+      case BLOCK:
+        {
+          std::unique_lock<std::mutex> l(_mb);
+          _blocked.fetch_add(1);
+          if (slot.seq.load(std::memory_order_acquire) != seq && _running)
+            _cv.wait_for(l, std::chrono::milliseconds(100));
+          _blocked.fetch_sub(1);
+        }
+        break;
+    }
+  }
+  spins = 0;
+  return true;
+}
+
+void Pipeline::run(Consumer* c)
+{
+  auto next = c->cursor.load(std::memory_order_relaxed) + 1;
+  unsigned spins = 0;
+  while (waitFor(c, next, spins)) {
+    // consume the whole available batch before publishing the cursor
+    do {
+      c->handler(_slots[next & _mask].ev);
+      ++next;
+    } while (_slots[next & _mask].seq.load(std::memory_order_acquire) == next);
+    c->cursor.store(next - 1, std::memory_order_release);
+  }
+}
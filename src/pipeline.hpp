@@ -0,0 +1,94 @@
+#ifndef OUCH_PIPELINE_HPP
+#define OUCH_PIPELINE_HPP
+
+#include "util.hpp"
+#include "ouch.hpp"
+
+#include <atomic>
+#include <condition_variable>
+
+namespace OUCH {
+
+class Session;
+
+/**
+ * Disruptor style fan-out of inbound messages.
+ *
+ * I/O threads only decode and publish into a preallocated ring, every
+ * consumer (strategy, risk, drop-copy, persistence ...) runs on its own
+ * thread and reads the whole stream at its own sequence cursor. Publishers
+ * wait for the slowest consumer when the ring is full, nothing is dropped.
+ *
+ * Consumers must be added before start(), and a stopped pipeline can not be
+ * started again. Events are only valid inside the handler, copy what must
+ * outlive it.
+ */
+class Pipeline : public noncopyable
+{
+public:
+  enum WaitStrategy { BUSY_SPIN, YIELD, SLEEP, BLOCK };
+
+  static const size_t MAX_MESSAGE_SIZE = 200; // larger than any OUCH 4.2 message
+
+  struct Event
+  {
+    Session* session;
+    struct timespec rxtm;
+    uint32_t len;
+    char data[MAX_MESSAGE_SIZE];
+    Message& msg() { return *(Message*)data; }
+  };
+
+  typedef std::function<void(Event&)> handler_t;
+
+  // capacity is rounded up to a power of two
+  Pipeline(size_t capacity = 64 * 1024);
+  ~Pipeline();
+
+  void addConsumer(handler_t handler, WaitStrategy wait = YIELD);
+  void start();
+  void stop();
+
+  // false if len is above MAX_MESSAGE_SIZE, the pipeline is not running, or
+  // it stops while the ring is full
+  bool publish(Session* session, const struct timespec& rxtm, const void* msg, size_t len);
+
+private:
+  struct Slot
+  {
+    std::atomic<int64_t> seq; // sequence last published into this slot
+    Event ev;
+  };
+
+  struct Consumer
+  {
+    std::atomic<int64_t> cursor; // last sequence consumed
+    char pad[64 - sizeof(std::atomic<int64_t>)];
+    handler_t handler;
+    WaitStrategy wait;
+    std::thread* thread;
+  };
+
+  void run(Consumer* c);
+  bool waitFor(Consumer* c, int64_t seq, unsigned& spins);
+  int64_t minCursor() const;
+
+  Slot* _slots;
+  size_t _mask;
+  char _pad0[64];
+  std::atomic<int64_t> _claim; // next sequence to hand out to a publisher
+  char _pad1[64 - sizeof(std::atomic<int64_t>)];
+  std::atomic<int64_t> _gate; // cached minimum consumer cursor, refreshed when the ring looks full
+  char _pad2[64 - sizeof(std::atomic<int64_t>)];
+  std::vector<Consumer*> _consumers;
+  std::atomic<bool> _running;
+  bool _stopped;
+  bool _hasBlocking;
+  std::atomic<int> _blocked; // consumers parked on _cv
+  std::mutex _mb;
+  std::condition_variable _cv;
+};
+
+} // namespace OUCH
+
+#endif
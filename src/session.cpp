@@ -4,6 +4,7 @@
 #include "soupbin3.hpp"
 
 #include <fstream>
+#include <sstream>
 
 using namespace OUCH;
 
@@ -19,8 +20,155 @@ struct Timer : public i_poll_events
 private:
   Session& _session;
 };
+
+// A spare connection of a client session, connected ahead of time to one of
+// its hosts so that it can log on over it as soon as the one in use fails.
+// It does not log on until it is taken, SoupBinTCP allowing one login per
+// session; what the peer sends is dropped. A peer with a login timeout
+// closes it after a while, it is opened again ReconnectInterval later.
+struct Standby : public i_poll_events
+{
+  Standby(Session& s, size_t host) : host(host), ready(false), _session(s), _fd(-1), _handle(NULL), _retryAt(0) {}
+  ~Standby() { if (_fd >= 0) closeSock(_fd); }
+  void start();
+  int take();
+  void in_event(int fd);
+  void out_event(int fd);
+
+  const size_t host;
+  bool ready;
+
+private:
+  void drop(const char* why);
+
+  Session& _session;
+  int _fd;
+  epoll_t::handle_t _handle;
+  time_t _retryAt; // after the peer closed it
+};
+}
+
+
+// Receive rings of all sessions by size, kept for the next session to
+// connect rather than unmapped
+static std::mutex _bufferPoolMutex;
+static std::map<size_t, std::vector<char*> > _bufferPool;
+
+void Session::Buffer::acquire(size_t size)
+{
+  if (data) return;
+  auto allocator = MYPIPE::Allocator::get();
+  size = allocator->ringSize(size);
+  std::lock_guard<std::mutex> l(_bufferPoolMutex);
+  auto& free = _bufferPool[size];
+  if (free.empty()) data = allocator->mapRing(size);
+  else {
+    data = free.back();
+    free.pop_back();
+  }
+  cap = size;
+  reset();
 }
 
+void Session::Buffer::grow()
+{
+  if (cap >= MAX_SIZE) return;
+  auto old = data;
+  auto oldCap = cap;
+  auto oldStart = start;
+  auto n = len;
+  data = NULL;
+  acquire(std::min(cap * 2, MAX_SIZE));
+  memcpy(data, old + oldStart, n);
+  len = n;
+  std::lock_guard<std::mutex> l(_bufferPoolMutex);
+  _bufferPool[oldCap].push_back(old);
+}
+
+void Session::Buffer::release()
+{
+  if (!data) return;
+  std::lock_guard<std::mutex> l(_bufferPoolMutex);
+  _bufferPool[cap].push_back(data);
+  data = NULL;
+  cap = 0;
+  start = len = 0;
+}
+
+// Faults in, and with lock pins, what the first messages would: the
+// receive ring, parked in the pool for connecting, the outbound chunk and
+// the store and log queues. Then runs cycles of a message of every type
+// through what sending and receiving one does, short of the socket, the
+// store and the application. Only before connecting; false if pinning
+// failed.
+bool Session::warmUp(int cycles, bool lock)
+{
+  bool locked = true;
+  if (!_rxbuf.data) {
+    _rxbuf.acquire(_inboundBufferSize);
+    locked &= prefault(_rxbuf.data, 2 * _rxbuf.cap, lock);
+    _rxbuf.release();
+  }
+  std::ostringstream out;
+  for (int i = 0; i < cycles; ++i) {
+    out.seekp(0);
+    warmUp<OrderMsg>(out);
+    warmUp<ReplaceMsg>(out);
+    warmUp<CancelMsg>(out);
+    warmUp<ModifyMsg>(out);
+    warmUp<SysMsg>(out);
+    warmUp<AcceptedMsg>(out);
+    warmUp<ReplacedMsg>(out);
+    warmUp<CanceledMsg>(out);
+    warmUp<AIQCanceledMsg>(out);
+    warmUp<ExecMsg>(out);
+    warmUp<BrokenTradeMsg>(out);
+    warmUp<RejectedMsg>(out);
+    warmUp<CancelPendingMsg>(out);
+    warmUp<CancelRejectMsg>(out);
+    warmUp<PriorityMsg>(out);
+    warmUp<ModifiedMsg>(out);
+  }
+  {
+    lock_t l(_m);
+    size_t n;
+    auto room = _outpipe.room(n);
+    locked &= prefault(room, n, lock);
+  }
+  locked &= _store->warmUp(lock);
+  locked &= _log->warmUp(lock);
+  return locked;
+}
+
+// messages only ever received have no hton(), they go as they are
+template <typename T>
+static auto hton(T* msg, int) -> decltype(msg->hton(), void()) { msg->hton(); }
+template <typename T>
+static void hton(T* msg, long) {}
+
+// one message encoded as send() does, through the outbound pipe and back,
+// decoded as process() does and written out as a log would
+template <typename T>
+void Session::warmUp(std::ostream& out)
+{
+  char packet[sizeof(soupbin3_packet)+sizeof(T)];
+  auto head = (soupbin3_packet*)packet;
+  head->PacketLength = htons(sizeof(T)+1);
+  head->PacketType = SOUPBIN3_PACKET_SEQ_DATA;
+  auto body = (T*)(head+1);
+  memset((void*)body, ' ', sizeof(T));
+  body->type = T::TYPE;
+  hton(body, 0);
+  {
+    lock_t l(_m);
+    _outpipe.push(packet, sizeof(packet));
+    const char* data;
+    size_t n;
+    while (_outpipe.data(data, n)) _outpipe.pop(n);
+  }
+  body->ntoh();
+  Log::write(out, body, sizeof(T) + 3);
+}
 
 static inline void lpadStr(char* dest, size_t destLen, const char* src, size_t srcLen)
 {
@@ -43,23 +191,38 @@ static inline void lpadStr(char* dest, size_t destLen, cstr_t& src)
 
 Session::Session(strmap_t settings) 
 : _settings(settings),
-  _username(get("Username")),
-  _password(get("Password")),
-  _firm(get("Firm")),
-  _senderCompId(get("SenderCompId")),
-  _targetCompId(get("TargetCompId")),
-  _reconnectInterval(15),
-  _isClient(get("ConnectionType") == "initiator" || get("ConnectionType") == "client"),
-  _app(NULL),
   _poll(NULL),
   _handle(NULL),
   _outpoll(NULL),
   _outhandle(NULL),
-  _timer(new Timer(*this)),
   _fd(-1),
   _state(st_none),
+  _isClient(get("ConnectionType") == "initiator" || get("ConnectionType") == "client"),
+  _maxMessagesPerRound(get("MaxMessagesPerRound", 0)),
+  _maxBytesPerRound(get("MaxBytesPerRound", 0)),
   _store(NULL),
-  _log(NULL)
+  _log(NULL),
+  _app(NULL),
+  _outpipe(get("OutboundChunkSize", (int)MYPIPE::CHUNK_SIZE), get("OutboundChunkPreallocate", 0)),
+  _username(get("Username")),
+  _password(get("Password")),
+  _firm(get("Firm")),
+  _senderCompId(get("SenderCompId")),
+  _targetCompId(get("TargetCompId")),
+  _reconnectInterval(15),
+  _connectTimeout(get("ConnectTimeout", 5)),
+  _reconnectBackoff(get("ReconnectBackoff", 0)),
+  _inboundBufferSize(std::min(Buffer::MAX_SIZE, ((size_t)std::max(get("InboundBufferSize", 64 << 10), 4096) + 4095) & ~(size_t)4095)), // pages
+  _timer(new Timer(*this)),
+  _host(0),
+  _resolving(false),
+  _stopped(false),
+  _backoff(0),
+  _connectFd(-1),
+  _connectHandle(NULL),
+  _connectedOnce(false),
+  _logons(0),
+  _replayFrom(0)
 {
   if (_senderCompId.empty() && _isClient) _senderCompId = _username;
   if (_targetCompId.empty() && !_isClient) {
@@ -71,6 +234,16 @@ Session::Session(strmap_t settings)
   _tfd = timerfd_create(CLOCK_REALTIME, 0);
   auto n = atoi(get("ReconnectInterval").c_str());
   if (n > 0) _reconnectInterval = n;
+  if (!_isClient) return;
+  // backup hosts are SocketConnectHost1, SocketConnectPort1 and so on
+  auto port = get("SocketConnectPort", 0);
+  _hosts.push_back(Host(get("SocketConnectHost"), port));
+  for (int i = 1; !get("SocketConnectHost" + itoa(i)).empty(); ++i)
+    _hosts.push_back(Host(get("SocketConnectHost" + itoa(i)), get("SocketConnectPort" + itoa(i), port)));
+  if (get("StandbyConnection", 0)) {
+    auto n = get("StandbyBackupHosts", 0) ? _hosts.size() : 1;
+    for (size_t i = 0; i < n; ++i) _standbys.push_back(new Standby(*this, i));
+  }
 }
 
 str_t Session::makeId(cstr_t& senderCompId, cstr_t& targetCompId)
@@ -95,6 +268,8 @@ sessions_t Session::createSessions(std::istream& stream)
 sessions_t Session::createSessions(const sections_t& sections)
 {
   sessions_t ans;
+  // process wide, so before the first session takes any buffer
+  if (!sections.empty()) setBufferAllocation(StrMapIgnoreCase(sections[0])["BufferAllocation"]);
   for (size_t i = 0; i < sections.size(); ++i) {
     StrMapIgnoreCase s(sections[i]);
     auto& username = s["Username"];
@@ -166,28 +341,160 @@ void Session::event(Session* p, const char* format, va_list args)
   }
 }
 
+// Starts a non-blocking connect, finished by connectDone() once the socket
+// turns writable or given up by the timer after ConnectTimeout seconds. The
+// first call comes from App::connect(), off the I/O thread, and resolves the
+// hosts; should that fail, later lookups run on resolveLater()'s thread.
 void Session::connect(bool firstTime)
 {
-  auto host = get("SocketConnectHost");
-  auto port = get("SocketConnectPort", 0);
-  auto fd = createClientSock(host.c_str(), port);
-  event("Connecting to %s on port %d", host.c_str(), port);
+  if (firstTime)
+    for (auto& h : _hosts) resolve(h);
+  auto& host = _hosts[_host];
+  if (!host.resolved) {
+    if (firstTime) {
+      event("Failed to resolve %s", host.name.c_str());
+      reconnect(true);
+      return;
+    }
+    resolveLater();
+    return;
+  }
+  event("Connecting to %s on port %d", host.name.c_str(), host.port);
+  bool pending;
+  auto fd = connectNonBlocking(host.addr, pending);
   if (fd < 0) {
-    event("Connection failed");
+    event("Connection failed: %s", strerror(errno));
+    reconnect(true);
+    return;
+  }
+  if (!pending) {
+    connected(fd);
+    return;
+  }
+  _connectFd = fd;
+  _connectHandle = _poll->add_fd(fd, this);
+  _poll->set_pollout(_connectHandle);
+  _state = st_connecting;
+  setTimer(_tfd, _connectTimeout, 0);
+}
+
+bool Session::resolve(Host& host)
+{
+  sockaddr_in addr;
+  if (!resolveHost(host.name.c_str(), host.port, addr)) return false;
+  host.addr = addr;
+  host.resolved = true;
+  return true;
+}
+
+// Looks up the current host off the I/O thread, which gets the address
+// back and connects. The thread only sees copies, hosts stay the I/O
+// thread's own.
+void Session::resolveLater()
+{
+  if (_resolving) return; // the lookup under way calls back
+  lock_t l(_resolverMutex);
+  if (_stopped) return;
+  if (_resolver.joinable()) _resolver.join(); // done, its result was posted
+  _resolving = true;
+  auto i = _host;
+  auto name = _hosts[i].name;
+  auto port = _hosts[i].port;
+  _resolver = std::thread([this, i, name, port]() {
+    sockaddr_in addr;
+    auto ok = resolveHost(name.c_str(), port, addr);
+    post([this, i, addr, ok]() {
+      _resolving = false;
+      auto& host = _hosts[i];
+      if (ok) {
+        host.addr = addr;
+        host.resolved = true;
+        connect();
+      } else {
+        event("Failed to resolve %s", host.name.c_str());
+        reconnect(true);
+      }
+    });
+  });
+}
+
+// After a failed connect or a lost connection: log on over a standby
+// connection if one is ready, otherwise try again once the reconnect delay
+// is up, the next host if the last one could not be reached.
+void Session::reconnect(bool nextHost)
+{
+  if (takeStandby()) return;
+  if (nextHost) _host = (_host + 1) % _hosts.size();
+  if (!_reconnectBackoff) {
     setTimer(_tfd, _reconnectInterval, 0);
     return;
   }
+  _backoff = _backoff ? std::min(_backoff * 2, _reconnectInterval * 1000) : _reconnectBackoff;
+  setTimerMs(_tfd, _backoff);
+}
+
+void Session::connectDone()
+{
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(_connectFd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) error = errno;
+  if (error) {
+    abortConnect((str_t("Connection failed: ") + strerror(error)).c_str());
+    return;
+  }
+  auto fd = _connectFd;
+  _poll->rm_fd(_connectHandle);
+  _connectFd = -1;
+  _state = st_none;
+  connected(fd);
+}
+
+void Session::abortConnect(const char* why)
+{
+  event("%s", why);
+  _poll->rm_fd(_connectHandle);
+  closeSock(_connectFd);
+  _connectFd = -1;
+  _state = st_session_terminated;
+  reconnect(true);
+}
+
+bool Session::takeStandby()
+{
+  while (true) {
+    Standby* standby = NULL;
+    for (auto p : _standbys)
+      if (p->ready && (!standby || p->host == _host)) standby = p;
+    if (!standby) return false;
+    auto fd = standby->take();
+    if (fd < 0) continue; // found closed, try the next one
+    _host = standby->host;
+    event("Switching to standby connection to %s on port %d", _hosts[_host].name.c_str(), _hosts[_host].port);
+    setTimer(_tfd, 0, 0);
+    post([this, fd]() { connected(fd); });
+    return true;
+  }
+}
+
+void Session::fillStandby()
+{
+  for (auto p : _standbys) p->start();
+}
+
+void Session::connected(int fd)
+{
   start(fd);
   auto rsize = get("ReceiveBufferSize", 0);
   auto ssize = get("SendBufferSize", 0);
   if (rsize > 0) setSockOpt(fd, SO_RCVBUF, rsize);
   if (ssize > 0) setSockOpt(fd, SO_SNDBUF, ssize);
   event("Connection succeeded");
-  if (firstTime)
+  if (!_connectedOnce)
     event("recv/send_buf=%d/%d tcp_nodelay=%d", 
         getSockOpt(fd, SO_RCVBUF),
         getSockOpt(fd, SO_SNDBUF),
         getSockOpt(fd, TCP_NODELAY));
+  _connectedOnce = true;
   logon();
 }
 
@@ -201,160 +508,196 @@ inline void Session::setNextTargetMsgSeqNum(int n)
   _store->setNextTargetMsgSeqNum(n);
 }
 
+// soupbin3 numbers are left padded with spaces
+static int parseSeqNum(const char (&s)[20])
+{
+  auto n = 0;
+  for (auto i = 0u; i < sizeof(s); ++i) {
+    if (s[i] == ' ') continue;
+    else n = n * 10 + (s[i] - '0');
+  }
+  return n;
+}
+
+inline void Session::deliver(Message* msg, size_t len)
+{
+  // a pipeline not running has nobody to hand the message to, nor has one
+  // a slot large enough for what a peer sent beyond any OUCH message
+  if (!_app->_pipeline || !_app->_pipeline->publish(this, _rxtm, msg, len))
+    _app->fromApp(*msg, *this);
+}
+
 void Session::in_event(int fd)
 {
-  if (_rxbuf.full()) _rxbuf.compact();
+  if (_state == st_connecting) {
+    connectDone();
+    return;
+  }
+  unsigned budget = _maxMessagesPerRound ? _maxMessagesPerRound : ~0u;
+  // serve what the previous round left over before reading more
+  if (_rxbuf.len && !process(budget)) return;
+  if (budget) {
+    if (_rxbuf.full()) _rxbuf.grow();
+    auto n = _rxbuf.remaining();
+    if (_maxBytesPerRound && n > _maxBytesPerRound) n = _maxBytesPerRound;
+    auto nr = ::read(fd, _rxbuf.end(), n);
+    if (nr > 0) {
+      clock_gettime(CLOCK_REALTIME, &_rxtm);
+      _rxbuf.len += nr;
+      if (!process(budget)) return;
+    } else if (nr == 0 || (errno != EAGAIN && errno != EINTR)) {
+      event("Connection reset by peer: nr=%d errno=%d", nr, errno);
+      close();
+      return;
+    }
+  }
+  // out of budget with whole packets buffered, let the other sessions on
+  // this reactor run and continue next round
+  if (!budget && _rxbuf.ready()) _poll->defer(_handle);
+}
+
+// dispatch buffered packets until budget runs out, false if session closed
+bool Session::process(unsigned& budget)
+{
   auto start = _rxbuf.begin();
-  auto nr = ::read(fd, _rxbuf.end(), _rxbuf.remaining());
-  if (nr > 0) {
-    clock_gettime(CLOCK_REALTIME, &_rxtm);
-    _rxbuf.len += nr;
-    while (_rxbuf.len > 2) {
-      unsigned len = 2 + (start[1] | start[0] << 8);
-      // std::cout << len << '\n';
-      if (len <= _rxbuf.len) {
-        if (len > 2) {
-          auto msg = (Message*)(start + 3);
-          bool countseq = true;
-          switch (start[2]) { // type
-            case SOUPBIN3_PACKET_SEQ_DATA:
-              {
-                switch (msg->type) {
-                  case AcceptedMsg::TYPE:
-                    ((AcceptedMsg*)msg)->ntoh();
-                    break;
-                  case ReplacedMsg::TYPE:
-                    ((ReplacedMsg*)msg)->ntoh();
-                    break;
-                  case CanceledMsg::TYPE:
-                    ((CanceledMsg*)msg)->ntoh();
-                    break;
-                  case AIQCanceledMsg::TYPE:
-                    ((AIQCanceledMsg*)msg)->ntoh();
-                    break;
-                  case ExecMsg::TYPE:
-                    ((ExecMsg*)msg)->ntoh();
-                    break;
-                  case BrokenTradeMsg::TYPE:
-                    ((BrokenTradeMsg*)msg)->ntoh();
-                    break;
-                  case RejectedMsg::TYPE:
-                    {
-                      auto m = ((RejectedMsg*)msg);
-                      m->ntoh();
-                      if (m->reason == 'T')
-                        countseq = false; // ignore test-mode rejections when counting seq
-                    }
-                    break;
-                  case CancelPendingMsg::TYPE:
-                    ((CancelPendingMsg*)msg)->ntoh();
-                    break;
-                  case CancelRejectMsg::TYPE:
-                    ((CancelRejectMsg*)msg)->ntoh();
-                    break;
-                  case PriorityMsg::TYPE:
-                    ((PriorityMsg*)msg)->ntoh();
-                    break;
-                  case ModifiedMsg::TYPE:
-                    ((ModifiedMsg*)msg)->ntoh();
-                    break;
-                  case SysMsg::TYPE:
-                    ((SysMsg*)msg)->ntoh();
-                    break;
-                  default:
-                    event("unknown OUCH message type %c", msg->type);
-                    close();
-                    return;
-                    break;
-                }
-                _log->onIncoming(msg,  len);
-                _app->fromApp(*msg, *this);
-              }
-              if (countseq) incrNextTargetMsgSeqNum();
-              break;
-            case SOUPBIN3_PACKET_LOGIN_ACCEPTED:
-              {
-                event("Login accepted: %s", 
-                    std::string(start+3, sizeof(soupbin3_packet_login_accepted)-3).c_str());
-                auto msg = (soupbin3_packet_login_accepted*)start;
-                auto n = 0;
-                for (auto i = 0u; i < sizeof(msg->SequenceNumber); ++i) {
-                  if (msg->SequenceNumber[i] == ' ') continue;
-                  else n = n * 10 + (msg->SequenceNumber[i] - '0');
+  while (_rxbuf.len > 2 && budget) {
+    unsigned len = 2 + ((unsigned char)start[1] | (unsigned char)start[0] << 8);
+    // std::cout << len << '\n';
+    if (len > _rxbuf.len) break;
+    --budget;
+    if (len > 2) {
+      auto msg = (Message*)(start + 3);
+      bool countseq = true;
+      switch (start[2]) { // type
+        case SOUPBIN3_PACKET_SEQ_DATA:
+          {
+            switch (msg->type) {
+              case AcceptedMsg::TYPE:
+                ((AcceptedMsg*)msg)->ntoh();
+                break;
+              case ReplacedMsg::TYPE:
+                ((ReplacedMsg*)msg)->ntoh();
+                break;
+              case CanceledMsg::TYPE:
+                ((CanceledMsg*)msg)->ntoh();
+                break;
+              case AIQCanceledMsg::TYPE:
+                ((AIQCanceledMsg*)msg)->ntoh();
+                break;
+              case ExecMsg::TYPE:
+                ((ExecMsg*)msg)->ntoh();
+                break;
+              case BrokenTradeMsg::TYPE:
+                ((BrokenTradeMsg*)msg)->ntoh();
+                break;
+              case RejectedMsg::TYPE:
+                {
+                  auto m = ((RejectedMsg*)msg);
+                  m->ntoh();
+                  if (m->reason == 'T')
+                    countseq = false; // ignore test-mode rejections when counting seq
                 }
-                if (n != getExpectedTargetNum())
-                  setNextTargetMsgSeqNum(n);
-                _state = st_logon_received;
-                _app->onLogon(*this);
-              }
-              assert(len == sizeof(soupbin3_packet_login_accepted));
-              break;
-            case SOUPBIN3_PACKET_LOGIN_REJECTED:
-              event("Login rejected: %c", start[3]);
-              close();
-              assert(len == sizeof(soupbin3_packet_login_rejected));
-              return;
-              break;
-            case SOUPBIN3_PACKET_SERVER_HEARTBEAT:
-              assert(len == sizeof(soupbin3_packet_server_heartbeat));
-              break;
-            case SOUPBIN3_PACKET_END_OF_SESSION:
-              event("End of session by peer");
-              close();
-              assert(len == sizeof(soupbin3_packet_end_of_session));
-	      return;
-              break;
-            case SOUPBIN3_PACKET_CLIENT_HEARTBEAT:
-              assert(len == sizeof(soupbin3_packet_client_heartbeat));
-              break;
-            case SOUPBIN3_PACKET_LOGIN_REQUEST:
-              {
-                event("Received logon request: %s", 
-                    std::string(start+3, sizeof(soupbin3_packet_login_request)-3).c_str());
-                soupbin3_packet_login_accepted msg;
-                msg.PacketLength = htons(sizeof(msg)-2);
-                msg.PacketType = SOUPBIN3_PACKET_LOGIN_ACCEPTED;
-                memset(msg.Session, ' ', sizeof(msg.Session)); 
-                char buf[20];
-                snprintf(buf, sizeof(buf), "%d", getExpectedSenderNum());
-                L_PAD_STR(msg.SequenceNumber, buf);
-                send(&msg, sizeof(msg));
-              }
-              assert(len == sizeof(soupbin3_packet_login_request));
-              break;
-            case SOUPBIN3_PACKET_UNSEQ_DATA:
-              {
-                // for test only
-                switch (msg->type) {
-                  case OrderMsg::TYPE:
-                    ((OrderMsg*)msg)->ntoh();
-                    break;
-                  case ReplaceMsg::TYPE:
-                    ((ReplaceMsg*)msg)->ntoh();
-                    break;
-                  case CancelMsg::TYPE:
-                    ((CancelMsg*)msg)->ntoh();
-                    break;
-                }
-                _log->onIncoming(msg,  len);
-                _app->fromApp(*msg, *this);
-              }
-              break;
+                break;
+              case CancelPendingMsg::TYPE:
+                ((CancelPendingMsg*)msg)->ntoh();
+                break;
+              case CancelRejectMsg::TYPE:
+                ((CancelRejectMsg*)msg)->ntoh();
+                break;
+              case PriorityMsg::TYPE:
+                ((PriorityMsg*)msg)->ntoh();
+                break;
+              case ModifiedMsg::TYPE:
+                ((ModifiedMsg*)msg)->ntoh();
+                break;
+              case SysMsg::TYPE:
+                ((SysMsg*)msg)->ntoh();
+                break;
+              default:
+                event("unknown OUCH message type %c", msg->type);
+                close();
+                return false;
+                break;
+            }
+            _log->onIncoming(msg,  len);
+            deliver(msg, len - 3);
+          }
+          if (countseq) incrNextTargetMsgSeqNum();
+          break;
+        case SOUPBIN3_PACKET_LOGIN_ACCEPTED:
+          {
+            event("Login accepted: %s", 
+                std::string(start+3, sizeof(soupbin3_packet_login_accepted)-3).c_str());
+            auto msg = (soupbin3_packet_login_accepted*)start;
+            auto n = parseSeqNum(msg->SequenceNumber);
+            if (n != getExpectedTargetNum())
+              setNextTargetMsgSeqNum(n);
+            _state = st_logon_received;
+            _backoff = 0;
+            fillStandby();
+            _app->onLogon(*this);
           }
-        }
-        _rxbuf.advance(len);
-        start = _rxbuf.begin();
-      } else
-        break;
+          assert(len == sizeof(soupbin3_packet_login_accepted));
+          break;
+        case SOUPBIN3_PACKET_LOGIN_REJECTED:
+          event("Login rejected: %c", start[3]);
+          close();
+          assert(len == sizeof(soupbin3_packet_login_rejected));
+          return false;
+          break;
+        case SOUPBIN3_PACKET_SERVER_HEARTBEAT:
+          assert(len == sizeof(soupbin3_packet_server_heartbeat));
+          break;
+        case SOUPBIN3_PACKET_END_OF_SESSION:
+          event("End of session by peer");
+          close();
+          assert(len == sizeof(soupbin3_packet_end_of_session));
+            return false;
+          break;
+        case SOUPBIN3_PACKET_CLIENT_HEARTBEAT:
+          assert(len == sizeof(soupbin3_packet_client_heartbeat));
+          break;
+        case SOUPBIN3_PACKET_LOGIN_REQUEST:
+          {
+            event("Received logon request: %s", 
+                std::string(start+3, sizeof(soupbin3_packet_login_request)-3).c_str());
+            auto msg = (soupbin3_packet_login_request*)start;
+            acceptLogon(parseSeqNum(msg->RequestedSequenceNumber));
+          }
+          assert(len == sizeof(soupbin3_packet_login_request));
+          break;
+        case SOUPBIN3_PACKET_UNSEQ_DATA:
+          {
+            // for test only
+            switch (msg->type) {
+              case OrderMsg::TYPE:
+                ((OrderMsg*)msg)->ntoh();
+                break;
+              case ReplaceMsg::TYPE:
+                ((ReplaceMsg*)msg)->ntoh();
+                break;
+              case CancelMsg::TYPE:
+                ((CancelMsg*)msg)->ntoh();
+                break;
+            }
+            _log->onIncoming(msg,  len);
+            deliver(msg, len - 3);
+          }
+          break;
+      }
     }
-  } else if (nr == 0 || (errno != EAGAIN && errno != EINTR)) {
-    event("Connection reset by peer: nr=%d errno=%d", nr, errno);
-    close();
+    _rxbuf.advance(len);
+    start = _rxbuf.begin();
   }
+  return true;
 }
 
 void Session::out_event(int fd)
 {
+  if (_state == st_connecting) {
+    connectDone();
+    return;
+  }
   const char* data;
   size_t n;
   if (_outpipe.data(data, n)) {
@@ -372,11 +715,12 @@ void Session::close()
   _poll->rm_fd(_handle);
   if (_poll != _outpoll) _outpoll->rm_fd(_outhandle);
   closeSock(_fd);
-  _rxbuf.reset();
+  _rxbuf.release();
   _outpipe.reset();
-  setTimer(_tfd, isClient() ? _reconnectInterval : 0, 0);
   _fd = -1;
   _state = st_session_terminated;
+  if (isClient()) reconnect(false);
+  else setTimer(_tfd, 0, 0);
 }
 
 void Timer::in_event(int fd)
@@ -384,6 +728,10 @@ void Timer::in_event(int fd)
   char buf[256];
   if (read(fd, buf, sizeof(buf))) {} // have to read because we are not using EPOLLET mode
 
+  if (_session._state == st_connecting) {
+    _session.abortConnect("Connection timed out");
+    return;
+  }
   if (_session._fd < 0) {
     _session.connect();
     return;
@@ -402,18 +750,101 @@ void Timer::in_event(int fd)
   diff = now.tv_sec + now.tv_nsec / 1.e9 - _session._txtm.tv_sec - _session._txtm.tv_nsec / 1.e9;
   if (diff >= 1)
     _session.heartbeat();
+  _session.fillStandby();
+}
+
+void Standby::start()
+{
+  auto& h = _session._hosts[host];
+  if (_fd >= 0 || !h.resolved || time(NULL) < _retryAt) return;
+  bool pending;
+  _fd = connectNonBlocking(h.addr, pending);
+  if (_fd < 0) return;
+  _handle = _session._poll->add_fd(_fd, this);
+  if (pending) _session._poll->set_pollout(_handle);
+  else out_event(_fd);
+}
+
+// the connection, or -1 if the peer closed it in the meantime
+int Standby::take()
+{
+  char c;
+  auto nr = recv(_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (nr == 0 || (nr < 0 && errno != EAGAIN && errno != EINTR)) {
+    drop("closed by peer");
+    return -1;
+  }
+  auto fd = _fd;
+  _session._poll->rm_fd(_handle);
+  _fd = -1;
+  ready = false;
+  return fd;
+}
+
+void Standby::in_event(int fd)
+{
+  char buf[256];
+  auto nr = ::read(fd, buf, sizeof(buf));
+  if (nr == 0 || (nr < 0 && errno != EAGAIN && errno != EINTR))
+    drop("closed by peer");
+}
+
+void Standby::out_event(int fd)
+{
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) error = errno;
+  if (error) {
+    drop(strerror(error));
+    return;
+  }
+  _session._poll->reset_pollout(_handle);
+  _session._poll->set_pollin(_handle);
+  ready = true;
+  auto& h = _session._hosts[host];
+  _session.event("Standby connection to %s on port %d ready", h.name.c_str(), h.port);
+}
+
+// connected again on a later tick of the session timer, not before
+// ReconnectInterval if the peer had it open and closed it
+void Standby::drop(const char* why)
+{
+  if (ready) {
+    auto& h = _session._hosts[host];
+    _session.event("Standby connection to %s on port %d lost: %s", h.name.c_str(), h.port, why);
+    _retryAt = time(NULL) + _session._reconnectInterval;
+  }
+  _session._poll->rm_fd(_handle);
+  closeSock(_fd);
+  _fd = -1;
+  ready = false;
 }
 
 void Session::start(int fd)
 {  
   _fd = fd;
+  _rxbuf.acquire(_inboundBufferSize);
   if (setNonBlocking(fd)) event("Failed to set non blocking mode");
   _handle = _poll->add_fd(fd, this);
   _poll->set_pollin(_handle);
   _outhandle = _poll == _outpoll ? _handle : _outpoll->add_fd(fd, this);
+  clock_gettime(CLOCK_REALTIME, &_rxtm); // the peer has ReconnectInterval to speak first
   setTimer(_tfd, 1, 1);
 }
 
+// Takes a connection the acceptor routed here by its login request, which
+// it has read already; false if the session has a connection
+bool Session::accept(int fd, const char* login, size_t len)
+{
+  if (_fd >= 0) return false;
+  start(fd);
+  memcpy(_rxbuf.end(), login, len);
+  _rxbuf.len += len;
+  unsigned budget = ~0u;
+  process(budget);
+  return true;
+}
+
 bool Session::send(void* data, size_t len)
 {
   if (_fd < 0) return true;
@@ -428,6 +859,82 @@ bool Session::send(void* data, size_t len)
   return true;
 }
 
+// sequenced packets are journaled even when nobody is logged on, the client
+// gets them replayed from the store when it logs on
+bool Session::sendSequenced(void* data, size_t len)
+{
+  lock_t lock(_m);
+
+  _store->set(data, len);
+  _store->incrNextSenderMsgSeqNum();
+  if (_fd < 0 || _state != st_logon_received) return true;
+
+  clock_gettime(CLOCK_REALTIME, &_txtm);
+  _outpipe.push((char*)data, len);
+  _outpoll->set_pollout(_outhandle);
+
+  return true;
+}
+
+// Replays from the requested sequence number, blank or 0 meaning the next
+// one, and goes live. Sequenced sends meanwhile are only stored, and
+// replayed along.
+void Session::acceptLogon(int requestedSeqNum)
+{
+  lock_t lock(_m);
+
+  auto next = getExpectedSenderNum();
+  if (requestedSeqNum <= 0 || requestedSeqNum > next) requestedSeqNum = next;
+
+  soupbin3_packet_login_accepted msg;
+  msg.PacketLength = htons(sizeof(msg)-2);
+  msg.PacketType = SOUPBIN3_PACKET_LOGIN_ACCEPTED;
+  memset(msg.Session, ' ', sizeof(msg.Session)); 
+  char buf[20];
+  snprintf(buf, sizeof(buf), "%d", requestedSeqNum);
+  L_PAD_STR(msg.SequenceNumber, buf);
+  _outpipe.push((char*)&msg, sizeof(msg));
+  ++_logons;
+  _replayFrom = requestedSeqNum;
+  replay(requestedSeqNum);
+}
+
+// Resends from begin what the store serves without waiting for its writer
+// thread, and goes live once that is all there is. Otherwise the store calls
+// back when its writer has caught up and the rest follows then, the I/O
+// thread and the other sessions on it never wait for the writer. With _m.
+void Session::replay(int begin)
+{
+  auto next = getExpectedSenderNum();
+  auto end = std::min(next - 1, _store->readable());
+  if (begin <= end) {
+    msgviews_t views;
+    _store->get(begin, end, views);
+    // packets stored one after another are adjacent in the store, copy runs
+    for (size_t i = 0; i < views.size();) {
+      auto data = views[i].data;
+      auto len = views[i].len;
+      for (++i; i < views.size() && views[i].data == data + len; ++i) len += views[i].len;
+      _outpipe.push(data, len);
+    }
+    begin = end + 1;
+  }
+  _outpoll->set_pollout(_outhandle);
+  if (begin < next) {
+    auto logons = _logons;
+    _store->whenReadable([this, logons, begin]() {
+      post([this, logons, begin]() {
+        lock_t lock(_m);
+        if (logons == _logons && _fd >= 0) replay(begin);
+      });
+    });
+    return;
+  }
+  if (_replayFrom < next) event("Replayed %d messages from %d", next - _replayFrom, _replayFrom);
+  _state = st_logon_received;
+  clock_gettime(CLOCK_REALTIME, &_txtm);
+}
+
 void Session::logon()
 {
   soupbin3_packet_login_request msg;
@@ -467,14 +974,22 @@ void Session::heartbeat()
 
 void Session::stop(bool wait)
 {
+  {
+    lock_t l(_resolverMutex);
+    _stopped = true;
+    if (_resolver.joinable()) _resolver.join();
+  }
   if (_log) _log->stop(wait);
   if (_store) _store->stop(wait);
 }
 
 Session::~Session()
 {
+  if (_resolver.joinable()) _resolver.join();
   delete _log;
   delete _store;
+  _rxbuf.release();
   delete _timer;
+  for (auto p : _standbys) delete p;
 }
 
@@ -15,9 +15,11 @@ namespace OUCH {
 
 class Session;
 class App;
+struct Standby;
+struct PendingLogin;
 typedef std::vector<Session*> sessions_t;
 enum SessionState { 
-  st_none, st_session_terminated,
+  st_none, st_session_terminated, st_connecting,
   st_logon_sent, st_logon_received, st_logoff_sent,
   st_num_states
 };
@@ -50,6 +52,10 @@ public:
   bool isLoggedOn() const { return _state == st_logon_received; }
   bool resendRequested() const { return true; }
 
+  // run task on the I/O thread that owns this session, so that session state
+  // can be touched without locking; valid once App::connect()/listen() is done
+  void post(epoll_t::task_t task) { _poll->post(std::move(task)); }
+
   template <typename T>
   bool send(const T& msg)
   {
@@ -60,78 +66,145 @@ public:
     auto body = (T*)(head+1);
     *body = msg;
     body->hton();
-    send(&packet, sizeof(packet));
+    if (isClient()) send(&packet, sizeof(packet));
+    else sendSequenced(&packet, sizeof(packet));
     _log->onOutgoing(&msg, sizeof(T));
     return true;
   }
 
 private:
   bool send(void* data, size_t len);
+  bool sendSequenced(void* data, size_t len);
   void event(const char* format, ...);
   static void event(Session* p, const char* format, ...);
   static void event(Session* p, const char* format, va_list args);
   void connect(bool firstTime=false);
+  struct Host;
+  bool resolve(Host& host);
+  void resolveLater();
+  void reconnect(bool nextHost);
+  bool takeStandby();
+  void fillStandby();
+  void connected(int fd);
+  void connectDone();
+  void abortConnect(const char* why);
   void close();
   void start(int fd);
+  bool accept(int fd, const char* login, size_t len);
   void in_event(int fd);
+  bool process(unsigned& budget);
   void out_event(int fd);
+  void deliver(Message* msg, size_t len);
   void logon();
+  void acceptLogon(int requestedSeqNum);
+  void replay(int begin);
   void heartbeat();
   void logout();
   void incrNextTargetMsgSeqNum();
   void setNextTargetMsgSeqNum(int n);
   void stop(bool wait);
+  bool warmUp(int cycles, bool lock);
+  template <typename T> void warmUp(std::ostream& out);
 
 private:
-  strmap_t _settings;
-  str_t _username;
-  str_t _password;
-  str_t _firm;
-  str_t _senderCompId;
-  str_t _targetCompId;
-  str_t _id;
-  int _reconnectInterval;
-  bool _isClient;
   friend class App;
   friend class Server;
   friend class Acceptor;
   friend class Timer;
+  friend struct Standby;
+  friend struct PendingLogin;
   friend class _C;
-  App* _app;
+
+  strmap_t _settings; // first, the other fields are initialized from it
+
+  // Touched for every message. Kept together ahead of the configuration
+  // and reconnect state below, which a busy session hardly touches, and
+  // small: the receive buffer is held only while connected.
   epoll_t* _poll;
   epoll_t::handle_t _handle;
   epoll_t* _outpoll;
   epoll_t::handle_t _outhandle;
-  int _tfd; // timer file id
-  i_poll_events* _timer;
   int _fd;
   SessionState _state;
+  bool _isClient;
+  unsigned _maxMessagesPerRound; // 0: unlimited
+  unsigned _maxBytesPerRound; // 0: up to what fits in _rxbuf
   MessageStore* _store;
   Log* _log;
-  MYPIPE::Pipe _outpipe;
+  App* _app;
 
+  // inbound bytes in a ring from a pool shared by all sessions, mapped by
+  // the MYPIPE::Allocator of BufferAllocation, taken on connecting and
+  // given back on disconnecting; it starts at InboundBufferSize, rounded
+  // up to what the allocator maps, and doubles, up to MAX_SIZE, when a
+  // read finds it full. The ring is mapped twice back to back, a packet across its end
+  // is still contiguous, so it is parsed in place and never moved.
   struct Buffer {
-    Buffer() : start(0), len(0) {}
+    Buffer() : data(NULL), cap(0), start(0), len(0) {}
     void reset() { start = len = 0; }
     static const size_t FIX_MAX_MESSAGE_SIZE = 1024; // big enough for OUCH
-    bool full() const { return start + len + FIX_MAX_MESSAGE_SIZE > cap; }
-    size_t remaining() const { return cap - start - len; }
-    void advance(size_t n) { start += n; len -= n; }
-    void compact() { memmove(data, data + start, len); start = 0; }
+    static const size_t MAX_SIZE = 1024 * 1024;
+    bool full() const { return len + FIX_MAX_MESSAGE_SIZE > cap; }
+    size_t remaining() const { return cap - len; }
+    void advance(size_t n) { start += n; if (start >= cap) start -= cap; len -= n; }
+    bool ready() const { return len > 2 && 2 + (size_t)((unsigned char)data[start + 1] | (unsigned char)data[start] << 8) <= len; }
     char* begin() { return data + start; }
-    char* end() { return begin() + len; }
-    static const size_t cap = 1024 * 1024;
-    char data[cap];
+    char* end() { return begin() + len; } // may be in the mirror
+    void acquire(size_t size);
+    void grow();
+    void release();
+    char* data;
+    size_t cap;
     size_t start;
     size_t len;
   };
   Buffer _rxbuf;
   struct timespec _rxtm;
   struct timespec _txtm;
+  // chunks of OutboundChunkSize, the pool of that size holding at least
+  // OutboundChunkPreallocate from the start
+  MYPIPE::Pipe _outpipe;
  
   typedef std::lock_guard<std::mutex> lock_t;
   std::mutex _m;
 
+  str_t _username;
+  str_t _password;
+  str_t _firm;
+  str_t _senderCompId;
+  str_t _targetCompId;
+  str_t _id;
+  int _reconnectInterval;
+  int _connectTimeout; // seconds
+  int _reconnectBackoff; // ms, 0 for a fixed ReconnectInterval
+  size_t _inboundBufferSize;
+  int _tfd; // timer file id
+  i_poll_events* _timer;
+  // a client connects without blocking, to addresses resolved once, and
+  // moves on to the next host when one can not be reached
+  struct Host {
+    Host(cstr_t& name, int port) : name(name), port(port), resolved(false) {}
+    str_t name;
+    int port;
+    sockaddr_in addr;
+    bool resolved;
+  };
+  std::vector<Host> _hosts;
+  size_t _host; // connecting or connected to
+  // looks up a host that did not resolve at first, one lookup at a time;
+  // joined in stop(), after which no other is started
+  std::thread _resolver;
+  std::mutex _resolverMutex;
+  bool _resolving; // until the result is back on the I/O thread
+  bool _stopped;
+  std::vector<Standby*> _standbys;
+  int _backoff; // ms, the last reconnect delay since logging on
+  int _connectFd;
+  epoll_t::handle_t _connectHandle;
+  bool _connectedOnce;
+  unsigned _logons; // accepted, a replay step of an earlier one is dropped
+  int _replayFrom;
+
   typedef StrMapIgnoreCase _I;
 };
 
@@ -2,6 +2,10 @@
 
 #include "session.hpp"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 using namespace OUCH;
 
 bool MemoryStore::set(const void* data, size_t len)
@@ -19,9 +23,165 @@ void MemoryStore::get(int begin, int end, strvec_t& messages) const
     messages.push_back(find->second);
 }
 
-FileStore::FileStore(const Session& s)
-: _msgFile(0), _headerFile(0), _seqNumsFile(0), _sessionFile(0)
+void MemoryStore::get(int begin, int end, msgviews_t& views) const
+{
+  views.clear();
+  Messages::const_iterator find = _messages.find(begin);
+  for (; find != _messages.end() && find->first <= end; ++find)
+    views.push_back(MsgView(find->second.data(), find->second.size()));
+}
+
+ArenaStore::ArenaStore(size_t chunkSize, size_t maxMessages, size_t maxBytes)
+: _chunkSize(chunkSize), _maxMessages(maxMessages), _maxBytes(maxBytes)
+{
+  init();
+}
+
+ArenaStore::ArenaStore(const Session& s)
+: _chunkSize(s.get("ArenaChunkSize", (int)DEFAULT_CHUNK_SIZE)),
+  _maxMessages(s.get("ArenaMaxMessages", 0)), _maxBytes(s.get("ArenaMaxBytes", 0))
+{
+  init();
+}
+
+ArenaStore::~ArenaStore()
+{
+  for (auto& c : _chunks) delete [] c.mem;
+  for (auto& c : _spare) delete [] c.mem;
+  delete [] _entries;
+}
+
+void ArenaStore::init()
+{
+  if (!_chunkSize) _chunkSize = DEFAULT_CHUNK_SIZE;
+  // a bounded window never grows the entry ring
+  size_t n = 1;
+  while (n < (_maxMessages ? _maxMessages : 64 * 1024)) n <<= 1;
+  _entries = new MsgView[n];
+  _mask = n - 1;
+  _first = _end = 1;
+  _chunkBytes = 0;
+  _nextSenderMsgSeqNum = 1;
+  _nextTargetMsgSeqNum = 1;
+}
+
+bool ArenaStore::set(const void* data, size_t len)
+{
+  int msgSeqNum = getNextSenderMsgSeqNum();
+  if (msgSeqNum < _first || msgSeqNum - _end > (int)_mask) {
+    // sequence number moved out of the window, start over from it
+    dropBefore(_end);
+    _first = _end = msgSeqNum;
+  }
+  for (; _end <= msgSeqNum; ++_end) {
+    if (_maxMessages && (size_t)(_end - _first) >= _maxMessages) dropBefore(_first + 1);
+    else if ((size_t)(_end - _first) > _mask) grow();
+    entry(_end) = MsgView();
+  }
+  auto p = allocate(len, msgSeqNum);
+  memcpy(p, data, len);
+  entry(msgSeqNum) = MsgView(p, len);
+  return true;
+}
+
+void ArenaStore::get(int begin, int end, strvec_t& messages) const
+{
+  messages.clear();
+  for (int i = std::max(begin, _first); i <= end && i < _end; ++i) {
+    auto& v = entry(i);
+    if (v.data) messages.push_back(std::string(v.data, v.len));
+  }
+}
+
+void ArenaStore::get(int begin, int end, msgviews_t& views) const
+{
+  views.clear();
+  for (int i = std::max(begin, _first); i <= end && i < _end; ++i) {
+    auto& v = entry(i);
+    if (v.data) views.push_back(v);
+  }
+}
+
+void ArenaStore::reset()
+{
+  dropBefore(_end);
+  _first = _end = 1;
+  _nextSenderMsgSeqNum = 1;
+  _nextTargetMsgSeqNum = 1;
+  _creationTime.setCurrent();
+}
+
+char* ArenaStore::allocate(size_t len, int msgSeqNum)
+{
+  if (_chunks.empty() || _chunks.back().size - _chunks.back().used < len) {
+    size_t size = std::max(len, _chunkSize);
+    // retire the oldest chunks to stay within the byte budget
+    while (_maxBytes && !_chunks.empty() && _chunkBytes + size > _maxBytes
+           && _chunks.front().last < msgSeqNum)
+      dropBefore(_chunks.front().last + 1);
+    Chunk c;
+    if (size == _chunkSize && !_spare.empty()) {
+      c = _spare.back();
+      _spare.pop_back();
+    } else {
+      c.mem = new char[size];
+      c.size = size;
+    }
+    c.used = 0;
+    c.last = msgSeqNum;
+    _chunks.push_back(c);
+    _chunkBytes += size;
+  }
+  auto& c = _chunks.back();
+  auto p = c.mem + c.used;
+  c.used += len;
+  c.last = std::max(c.last, msgSeqNum);
+  return p;
+}
+
+// forget messages before msgSeqNum and recycle the chunks left unused
+void ArenaStore::dropBefore(int msgSeqNum)
+{
+  _first = std::max(_first, std::min(msgSeqNum, _end));
+  while (!_chunks.empty() && _chunks.front().last < _first) {
+    auto& c = _chunks.front();
+    _chunkBytes -= c.size;
+    if (c.size == _chunkSize) _spare.push_back(c);
+    else delete [] c.mem;
+    _chunks.pop_front();
+  }
+}
+
+void ArenaStore::grow()
 {
+  size_t n = (_mask + 1) * 2;
+  auto entries = new MsgView[n];
+  for (int i = _first; i < _end; ++i)
+    entries[i & (n - 1)] = entry(i);
+  delete [] _entries;
+  _entries = entries;
+  _mask = n - 1;
+}
+
+static const char INDEX_MAGIC[8] = {'O', 'U', 'C', 'H', 'I', 'D', 'X', '1'};
+static const char SEQNUMS_MAGIC[8] = {'O', 'U', 'C', 'H', 'S', 'E', 'Q', '1'};
+static const size_t SEQNUMS_PAGE_SIZE = 4096;
+
+FileStore::FileStore(const Session& s, bool batched)
+: _seqNumsSyncInterval(s.get("SeqNumsSyncInterval", 0)), _seqNumsDirty(0),
+  _durability(DURABILITY_PAGECACHE), _syncCount(s.get("StoreSyncCount", 0)),
+  _syncMicros(s.get("StoreSyncMicros", 0)), _unsynced(0), _written(0), _durable(0),
+  _bodyFile(s.get("FileStoreWriteBuffer", FileWriter::DEFAULT_BUFFER_SIZE),
+    (s.get("FileStoreDirectIO", 0) ? FileWriter::DIRECT : 0) | (batched && s.get("IoUring", 1) ? 0 : FileWriter::NO_URING),
+    s.get("FileStorePreallocate", 0)),
+  _batched(batched), _sessionFile(0), _body(NULL), _bodySize(0)
+{
+  auto durability = toLower(s.get("StoreDurability"));
+  if (durability == "none") _durability = DURABILITY_NONE;
+  else if (durability == "group") _durability = DURABILITY_GROUP;
+  else if (!durability.empty() && durability != "pagecache")
+    die("Unknown StoreDurability " + durability);
+
   auto path = mystrftime(s.get("FileStorePath"));
   if (path == s.get("FileStorePath")) path = mystrftime(path + "/%Y%m%d");
   mkdirs(path);
@@ -33,6 +193,7 @@ FileStore::FileStore(const Session& s)
   std::string prefix = path + '/' + sessionid + ".";
 
   _msgFileName = prefix + "body";
+  _indexFileName = prefix + "index";
   _headerFileName = prefix + "header";
   _seqNumsFileName = prefix + "seqnums";
   _sessionFileName = prefix + "session";
@@ -42,43 +203,44 @@ FileStore::FileStore(const Session& s)
 
 FileStore::~FileStore()
 {
-  if (_msgFile) fclose(_msgFile);
-  if (_headerFile) fclose(_headerFile);
-  if (_seqNumsFile) fclose(_seqNumsFile);
+  if (_unsynced) FileStore::sync();
+  if (_body) munmap(_body, _bodySize);
   if (_sessionFile) fclose(_sessionFile);
 }
 
 void FileStore::open(bool deleteFile)
 { 
-  if (_msgFile) fclose(_msgFile);
-  if (_headerFile) fclose(_headerFile);
-  if (_seqNumsFile) fclose(_seqNumsFile);
+  if (_unsynced) FileStore::sync();
+  if (_body) munmap(_body, _bodySize);
+  _bodyFile.close();
   if (_sessionFile) fclose(_sessionFile);
+  _index.close();
+  _seqNums.close();
 
-  _msgFile = 0;
-  _headerFile = 0;
-  _seqNumsFile = 0;
+  _body = NULL;
+  _bodySize = 0;
   _sessionFile = 0;
 
   if (deleteFile) {
     unlink(_msgFileName.c_str());
+    unlink(_indexFileName.c_str());
     unlink(_headerFileName.c_str());
     unlink(_seqNumsFileName.c_str());
     unlink(_sessionFileName.c_str());
   }
 
+  bool migrate = !exists(_indexFileName) && exists(_headerFileName);
   populateCache();
-  _msgFile = fopen(_msgFileName.c_str(), "r+");
-  if (!_msgFile) _msgFile = fopen(_msgFileName.c_str(), "w+");
-  if (!_msgFile) die("Could not open body file: " + _msgFileName);
 
-  _headerFile = fopen(_headerFileName.c_str(), "r+");
-  if (!_headerFile) _headerFile = fopen(_headerFileName.c_str(), "w+");
-  if (!_headerFile) die("Could not open header file: " + _headerFileName);
+  openSeqNums();
+  auto created = openIndex();
+  if (migrate) migrateHeaderFile();
+  else if (created) rebuildIndex();
+  recover();
+  _bodyFile.open(_msgFileName);
 
-  _seqNumsFile = fopen(_seqNumsFileName.c_str(), "r+");
-  if (!_seqNumsFile) _seqNumsFile = fopen(_seqNumsFileName.c_str(), "w+");
-  if (!_seqNumsFile) die("Could not open seqnums file: " + _seqNumsFileName);
+  _written = indexHeader()->end - 1;
+  _durable = _written;
 
   bool setCreationTime = false;
   _sessionFile = fopen(_sessionFileName.c_str(), "r");
@@ -89,35 +251,167 @@ void FileStore::open(bool deleteFile)
   if (!_sessionFile) _sessionFile = fopen(_sessionFileName.c_str(), "w+");
   if (!_sessionFile) die("Could not open session file");
   if (setCreationTime) setSession();
+}
 
-  setNextSenderMsgSeqNum(getNextSenderMsgSeqNum());
-  setNextTargetMsgSeqNum(getNextTargetMsgSeqNum());
+// true if the index file was created
+bool FileStore::openIndex()
+{
+  _index.open(_indexFileName, INDEX_INITIAL_RECORDS * sizeof(IndexRecord));
+  auto h = indexHeader();
+  if (!memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic))) return false;
+  for (size_t i = 0; i < sizeof(IndexHeader); ++i)
+    if (_index.data()[i]) die("Invalid index file: " + _indexFileName);
+  memcpy(h->magic, INDEX_MAGIC, sizeof(h->magic));
+  h->end = 1;
+  h->checkpoint = 1;
+  return true;
 }
 
-void FileStore::populateCache()
-{ 
-  std::string msg;
-
-  FILE* headerFile;
-  headerFile = fopen(_headerFileName.c_str(), "r+");
-  if (headerFile) {
-    int num, offset, size;
-    while (fscanf(headerFile, "%d,%d,%d ", &num, &offset, &size) == 3)
-      _offsets[num] = std::make_pair(offset, size);
-    fclose(headerFile);
+// Checks the messages stored since the last checkpoint against their CRC and
+// cuts the index before the first one torn by a crash, and the body after
+// the last one intact. Messages are appended in sequence number order, so
+// the last one in the index ends the body and the ones synced before the
+// checkpoint need not be visited.
+void FileStore::recover()
+{
+  auto fd = ::open(_msgFileName.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) dieerr("Could not open body file " + _msgFileName);
+  struct stat st;
+  if (fstat(fd, &st)) dieerr("Could not stat body file " + _msgFileName);
+  uint64_t size = st.st_size;
+  auto h = indexHeader();
+  if (!h->checkpoint) h->checkpoint = 1;
+  if (h->checkpoint > h->end) h->checkpoint = h->end;
+  const char* body = NULL;
+  if (size && h->checkpoint < h->end) {
+    auto p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) dieerr("Could not map body file " + _msgFileName);
+    body = (const char*)p;
+  }
+  uint64_t end = 0;
+  uint32_t n = h->checkpoint;
+  for (; n < h->end; ++n) {
+    auto r = indexRecord(n);
+    if (!r->len) continue;
+    if (r->offset + r->len > size || crc32c(0, body + r->offset, r->len) != r->crc) break;
+    end = r->offset + r->len;
   }
+  if (body) munmap((void*)body, size);
+  if (n < h->end) {
+    fprintf(stderr, "Cut messages %u to %u torn in %s\n", n, h->end - 1, _msgFileName.c_str());
+    memset(indexRecord(n), 0, (h->end - n) * sizeof(IndexRecord));
+    h->end = n;
+  }
+  if (!end)
+    for (auto i = h->checkpoint; i-- > 1;) {
+      auto r = indexRecord(i);
+      if (!r->len) continue;
+      end = r->offset + r->len;
+      break;
+    }
+  if (end < size && ftruncate(fd, end)) dieerr("Could not truncate body file " + _msgFileName);
+  ::close(fd);
+}
+
+// Rebuilds a lost index from the body, which holds the packets as sent, each
+// framed by its length. The last one is taken to be the one before the next
+// sender sequence number; whatever follows the last whole packet is cut by
+// recover().
+void FileStore::rebuildIndex()
+{
+  auto fd = ::open(_msgFileName.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  struct stat st;
+  if (fstat(fd, &st)) dieerr("Could not stat body file " + _msgFileName);
+  uint64_t size = st.st_size;
+  if (!size) {
+    ::close(fd);
+    return;
+  }
+  auto p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) dieerr("Could not map body file " + _msgFileName);
+  ::close(fd);
+  auto body = (const unsigned char*)p;
+  madvise(p, size, MADV_SEQUENTIAL);
+  std::vector<uint64_t> offsets;
+  uint64_t offset = 0;
+  while (offset + 2 <= size) {
+    auto len = 2 + (uint64_t)(body[offset] << 8 | body[offset + 1]);
+    if (len < 3 || offset + len > size) break;
+    offsets.push_back(offset);
+    offset += len;
+  }
+  offsets.push_back(offset); // the end of the last one
+  auto count = offsets.size() - 1;
+  auto first = std::max(1, seqNums()->sender.load() - (int)count);
+  auto need = (first + count) * sizeof(IndexRecord);
+  if (need > _index.size()) _index.resize(std::max(need, _index.size() * 2));
+  for (size_t i = 0; i < count; ++i) {
+    auto r = indexRecord(first + i);
+    r->offset = offsets[i];
+    r->len = offsets[i + 1] - offsets[i];
+    r->crc = crc32c(0, body + r->offset, r->len);
+  }
+  munmap(p, size);
+  auto h = indexHeader();
+  h->end = first + count;
+  h->checkpoint = h->end; // just checked
+  _index.sync();
+  fprintf(stderr, "Rebuilt index of %zu messages from %s\n", count, _msgFileName.c_str());
+}
+
+void FileStore::migrateHeaderFile()
+{
+  FILE* headerFile = fopen(_headerFileName.c_str(), "r");
+  if (!headerFile) return;
+  FILE* msgFile = fopen(_msgFileName.c_str(), "r");
+  if (!msgFile) die("Could not open body file: " + _msgFileName);
+  int num, offset, size;
+  std::string buf;
+  while (fscanf(headerFile, "%d,%d,%d ", &num, &offset, &size) == 3) {
+    if (num <= 0 || size <= 0) continue;
+    buf.resize(size);
+    if (fseek(msgFile, offset, SEEK_SET) || fread(&buf[0], 1, size, msgFile) != (size_t)size)
+      die("Unable to read from file " + _msgFileName);
+    auto need = (size_t)(num + 1) * sizeof(IndexRecord);
+    if (need > _index.size()) _index.resize(std::max(need, _index.size() * 2));
+    auto r = indexRecord(num);
+    r->offset = offset;
+    r->len = size;
+    r->crc = crc32c(0, buf.data(), size);
+    if ((uint32_t)num >= indexHeader()->end) indexHeader()->end = num + 1;
+  }
+  fclose(headerFile);
+  fclose(msgFile);
+}
 
-  FILE* seqNumsFile;
-  seqNumsFile = fopen(_seqNumsFileName.c_str(), "r+");
+void FileStore::openSeqNums()
+{
+  int sender = 1, target = 1;
+  FILE* seqNumsFile = fopen(_seqNumsFileName.c_str(), "r");
   if (seqNumsFile) {
-    int sender, target;
-    if (fscanf(seqNumsFile, "%d : %d", &sender, &target) == 2) {
-      _cache.setNextSenderMsgSeqNum(sender);
-      _cache.setNextTargetMsgSeqNum(target);
+    char magic[sizeof(SEQNUMS_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), seqNumsFile) != sizeof(magic)
+        || memcmp(magic, SEQNUMS_MAGIC, sizeof(magic))) {
+      rewind(seqNumsFile);
+      if (fscanf(seqNumsFile, "%d : %d", &sender, &target) != 2) sender = target = 1;
     }
     fclose(seqNumsFile);
   }
 
+  _seqNums.open(_seqNumsFileName, SEQNUMS_PAGE_SIZE);
+  auto p = seqNums();
+  if (!memcmp(p->magic, SEQNUMS_MAGIC, sizeof(p->magic))) return;
+  // new file or text written by older versions
+  memset(_seqNums.data(), 0, _seqNums.size());
+  p->sender.store(sender, std::memory_order_relaxed);
+  p->target.store(target, std::memory_order_relaxed);
+  memcpy(p->magic, SEQNUMS_MAGIC, sizeof(p->magic));
+  _seqNums.sync();
+}
+
+void FileStore::populateCache()
+{ 
   FILE* sessionFile;
   sessionFile = fopen(_sessionFileName.c_str(), "r+");
   if (sessionFile) {
@@ -131,28 +425,50 @@ void FileStore::populateCache()
 
 inline bool FileStore::set(int msgSeqNum, const void* data, size_t len)
 { 
-  if (fseek(_msgFile, 0, SEEK_END)) 
-    die("Cannot seek to end of " + _msgFileName);
-  if (fseek(_headerFile, 0, SEEK_END)) 
-    die("Cannot seek to end of " + _headerFileName);
-
-  int offset = ftell(_msgFile);
-  if (offset<0) 
-    die("Unable to get file pointer position from " + _msgFileName);
-
-  if (fprintf(_headerFile, "%d,%d,%ld ", msgSeqNum, offset, len)<0)
-    die("Unable to write to file " + _headerFileName);
-  _offsets[msgSeqNum] = std::make_pair(offset, len);
-  fwrite(data, sizeof(char), len, _msgFile);
-  if (ferror(_msgFile)) 
-    die("Unable to write to file " + _msgFileName);
-  if (fflush(_msgFile) == EOF) 
-    die("Unable to flush file " + _msgFileName);
-  if (fflush(_headerFile) == EOF) 
-    die("Unable to flush file " + _headerFileName);
+  if (msgSeqNum <= 0) return false;
+  auto offset = _bodyFile.append(data, len);
+  // a batched writer flushes when its queue drains instead
+  if (_durability != DURABILITY_NONE && !_batched) _bodyFile.flush();
+
+  auto need = (size_t)(msgSeqNum + 1) * sizeof(IndexRecord);
+  if (need > _index.size()) _index.resize(std::max(need, _index.size() * 2));
+  auto r = indexRecord(msgSeqNum);
+  r->offset = offset;
+  r->len = len;
+  r->crc = crc32c(0, data, len);
+  if ((uint32_t)msgSeqNum >= indexHeader()->end) indexHeader()->end = msgSeqNum + 1;
+
+  _written = std::max(_written, msgSeqNum);
+  if (_durability == DURABILITY_GROUP) {
+    if (!_unsynced++) clock_gettime(CLOCK_MONOTONIC, &_firstUnsynced);
+    if (syncDue()) FileStore::sync(); // already on the writing thread
+  }
   return true;
 }
 
+bool FileStore::syncDue() const
+{
+  if (_syncCount && _unsynced >= _syncCount) return true;
+  if (_syncMicros) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - _firstUnsynced.tv_sec) * 1000000L
+      + (now.tv_nsec - _firstUnsynced.tv_nsec) / 1000 >= _syncMicros;
+  }
+  return !_syncCount;
+}
+
+// one fdatasync covers every message written since the last one
+void FileStore::sync()
+{
+  _bodyFile.syncData();
+  indexHeader()->checkpoint = _written + 1;
+  _index.sync();
+  _unsynced = 0;
+  _durable.store(_written, std::memory_order_release);
+  if (_durableCallback) _durableCallback(_written);
+}
+
 bool FileStore::set(const void* data, size_t len)
 {
   return set(getNextSenderMsgSeqNum(), data, len);
@@ -160,47 +476,79 @@ bool FileStore::set(const void* data, size_t len)
 
 void FileStore::get(int begin, int end, strvec_t& result) const
 { 
+  msgviews_t views;
+  get(begin, end, views);
   result.clear();
-  std::string msg;
-  for (int i = begin; i <= end; ++i)
-  {
-    if (get(i, msg))
-      result.push_back(msg);
+  for (size_t i = 0; i < views.size(); ++i)
+    result.push_back(std::string(views[i].data, views[i].len));
+}
+
+// a range is a walk over the index and the mapped body, no syscall unless
+// the body grew beyond the current map
+void FileStore::get(int begin, int end, msgviews_t& views) const
+{
+  views.clear();
+  if (begin <= 0) begin = 1;
+  if (end >= (int)indexHeader()->end) end = indexHeader()->end - 1;
+  size_t size = 0;
+  for (int i = begin; i <= end; ++i) {
+    auto r = indexRecord(i);
+    if (r->len) size = std::max(size, (size_t)(r->offset + r->len));
+  }
+  if (!size) return;
+  mapBody(size);
+  for (int i = begin; i <= end; ++i) {
+    auto r = indexRecord(i);
+    if (r->len && r->offset + r->len <= _bodySize) views.push_back(MsgView(_body + r->offset, r->len));
   }
 }
 
+void FileStore::mapBody(size_t size) const
+{
+  if (size <= _bodySize) return;
+  if (!_batched) _bodyFile.flush(); // a batched body is flushed by its writer thread
+  struct stat st;
+  if (fstat(_bodyFile.fd(), &st)) 
+    dieerr("Unable to stat file " + _msgFileName);
+  if ((size_t)st.st_size <= _bodySize) return;
+  auto p = _body ? mremap(_body, _bodySize, st.st_size, MREMAP_MAYMOVE)
+    : mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, _bodyFile.fd(), 0);
+  if (p == MAP_FAILED) dieerr("Unable to map file " + _msgFileName);
+  _body = (char*)p;
+  _bodySize = st.st_size;
+}
+
 int FileStore::getNextSenderMsgSeqNum() const
 { 
-  return _cache.getNextSenderMsgSeqNum();
+  return seqNums()->sender.load(std::memory_order_acquire);
 }
 
 int FileStore::getNextTargetMsgSeqNum() const
 {
-  return _cache.getNextTargetMsgSeqNum();
+  return seqNums()->target.load(std::memory_order_acquire);
 }
 
 void FileStore::setNextSenderMsgSeqNum(int value)
 {
-  _cache.setNextSenderMsgSeqNum(value);
+  seqNums()->sender.store(value, std::memory_order_release);
   setSeqNum();
 }
 
 void FileStore::setNextTargetMsgSeqNum(int value)
 {
-  _cache.setNextTargetMsgSeqNum(value);
+  seqNums()->target.store(value, std::memory_order_release);
   setSeqNum();
 }
 
+// sequence numbers have a single writer, no need for an atomic increment
 void FileStore::incrNextSenderMsgSeqNum()
 {
-  _cache.incrNextSenderMsgSeqNum();
-  setSeqNum();
+  setNextSenderMsgSeqNum(getNextSenderMsgSeqNum() + 1);
 }
 
 void FileStore::incrNextTargetMsgSeqNum()
 {
-  _cache.incrNextTargetMsgSeqNum();
-  setSeqNum();
+  setNextTargetMsgSeqNum(getNextTargetMsgSeqNum() + 1);
 }
 
 UtcTimeStamp FileStore::getCreationTime() const
@@ -221,15 +569,12 @@ void FileStore::refresh()
   open(false);
 }
 
+// the page is already in the page cache, only forcing it to disk costs;
+// the sender and the I/O thread both count, whoever hits the interval syncs
 void FileStore::setSeqNum()
 {
-  rewind(_seqNumsFile);
-  fprintf(_seqNumsFile, "%10.10d : %10.10d",
-           getNextSenderMsgSeqNum(), getNextTargetMsgSeqNum());
-  if (ferror(_seqNumsFile)) 
-    die("Unable to write to file " + _seqNumsFileName);
-  if (fflush(_seqNumsFile)) 
-    die("Unable to flush file " + _seqNumsFileName);
+  if (!_seqNumsSyncInterval || ++_seqNumsDirty % _seqNumsSyncInterval) return;
+  syncSeqNums();
 }
 
 void FileStore::setSession()
@@ -245,24 +590,39 @@ void FileStore::setSession()
 
 bool FileStore::get(int msgSeqNum, std::string& msg) const
 {
-  NumToOffset::const_iterator find = _offsets.find(msgSeqNum);
-  if (find == _offsets.end()) return false;
-  const OffsetSize& offset = find->second;
-  if (fseek(_msgFile, offset.first, SEEK_SET)) 
-    die("Unable to seek in file " + _msgFileName);
-  char* buffer = new char[offset.second + 1];
-  if (fread(buffer, sizeof(char), offset.second, _msgFile) == 0) {}
-  if (ferror(_msgFile)) 
-    die("Unable to read from file " + _msgFileName);
-  buffer[offset.second] = 0;
-  msg = buffer;
-  delete [] buffer;
+  msgviews_t views;
+  get(msgSeqNum, msgSeqNum, views);
+  if (views.empty()) return false;
+  msg.assign(views[0].data, views[0].len); // OUCH messages are binary, may hold NUL
   return true;
 }
 
+AsyncFileStore::AsyncFileStore(const Session& s)
+: FileStore(s, true), Queue(s.get("QueueChunkSize", (int)CHUNK_SIZE), s.get("QueueChunkPreallocate", 0)),
+  _lastSet(getNextSenderMsgSeqNum() - 1), _readable(_lastSet), _tfd(-1)
+{
+  if (_durability == DURABILITY_GROUP && _syncMicros) {
+    _tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (_tfd < 0) dieerr("Unable to create timer for " + _msgFileName);
+    _poll.set_pollin(_poll.add_fd(_tfd, this));
+  }
+}
+
+AsyncFileStore::~AsyncFileStore()
+{
+  if (_tfd >= 0) ::close(_tfd);
+}
+
 void AsyncFileStore::in_event(int fd)
 {
   uint64_t value;
+  if (fd == _tfd) {
+    if (read(fd, &value, 8)) {}
+    lock_t l(_mf);
+    if (_unsynced) FileStore::sync();
+    flushed();
+    return;
+  }
   if (!read(fd, &value, 8)) {assert(0);} // have to read because we are not using EPOLLET mode
   getData();
   auto _data = (char*)(_h + 1);
@@ -272,14 +632,52 @@ void AsyncFileStore::in_event(int fd)
         lock_t l(_mf);
         auto n = (int*)_data;
         FileStore::set(*n, _data+4, _h->len - 4);
+        _lastSet = *n;
+        if (_unsynced == 1 && _tfd >= 0) {
+          struct itimerspec t = {{0, 0}, {_syncMicros / 1000000, _syncMicros % 1000000 * 1000}};
+          timerfd_settime(_tfd, 0, &t, NULL);
+        }
       }
       break;
     case SET_SEQNUM:
-      FileStore::setSeqNum();
+      FileStore::syncSeqNums();
+      break;
+    case SYNC:
+      {
+        lock_t l(_mf);
+        FileStore::sync();
+        flushed();
+      }
+      break;
+    case FLUSH:
+      {
+        lock_t l(_mf);
+        _bodyFile.flush();
+        flushed();
+        (*(std::atomic<bool>**)_data)->store(true, std::memory_order_release);
+      }
+      break;
+    case NOTIFY:
+      {
+        auto done = *(std::function<void()>**)_data;
+        {
+          lock_t l(_mf);
+          _bodyFile.flush();
+          flushed();
+        }
+        (*done)();
+        delete done;
+      }
       break;
     default:
       assert(0);
   }
   release();
+  if (!drained()) return;
+  // one write, and for group commit without bounds one sync, per burst
+  lock_t l(_mf);
+  if (_unsynced && !_syncCount && !_syncMicros) FileStore::sync();
+  else if (_durability != DURABILITY_NONE) _bodyFile.flush();
+  else return;
+  flushed();
 }
-
@@ -3,9 +3,22 @@
 
 #include "datetime.hpp"
 #include "util.hpp"
+#include "writer.hpp"
+
+#include <climits>
+#include <deque>
 
 namespace OUCH
 {
+// A stored message in place, without copying it out of the store.
+struct MsgView
+{
+  MsgView(const char* data=NULL, size_t len=0) : data(data), len(len) {}
+  const char* data;
+  size_t len;
+};
+typedef std::vector<MsgView> msgviews_t;
+
 /**
  * This interface must be implemented to store and retrieve messages and
  * sequence numbers.
@@ -17,6 +30,21 @@ public:
 
   virtual bool set(const void* data, size_t len) = 0;
   virtual void get(int, int, strvec_t&) const = 0;
+  // Messages [begin, end] in place, valid until the store is used again.
+  // Stores should override it, the default copies through get() above.
+  virtual void get(int begin, int end, msgviews_t& views) const
+  {
+    get(begin, end, _scratch);
+    views.clear();
+    for (size_t i = 0; i < _scratch.size(); ++i)
+      views.push_back(MsgView(_scratch[i].data(), _scratch[i].size()));
+  }
+
+  // Highest sequence number get() serves without waiting for a writer
+  // thread. whenReadable() has done called, from any thread, once all
+  // messages stored so far are; stores that never wait serve them all.
+  virtual int readable() const { return INT_MAX; }
+  virtual void whenReadable(std::function<void()> done) const { done(); }
 
   virtual int getNextSenderMsgSeqNum() const = 0;
   virtual int getNextTargetMsgSeqNum() const = 0;
@@ -30,6 +58,12 @@ public:
   virtual void reset() = 0;
   virtual void refresh() = 0;
   virtual void stop(bool wait) {}
+  // readies buffers before the first message, see App's WarmUp; false if
+  // they were to be pinned and could not be
+  virtual bool warmUp(bool lock) { return true; }
+
+protected:
+  mutable strvec_t _scratch;
 };
 
 /**
@@ -45,6 +79,7 @@ public:
 
   bool set(const void* data, size_t len);
   void get(int, int, strvec_t&) const;
+  void get(int, int, msgviews_t&) const;
 
   int getNextSenderMsgSeqNum() const
   { return _nextSenderMsgSeqNum; }
@@ -82,6 +117,91 @@ private:
 
 class Session;
 
+/**
+ * Memory based implementation of MessageStore without per message allocation.
+ *
+ * Messages are appended into large arena chunks and found through a dense
+ * array of views indexed by sequence number. By default everything is kept;
+ * with a retention window only the last maxMessages messages, or the messages
+ * in the last maxBytes of chunks, are kept and older chunks are recycled, so
+ * the window moves a chunk at a time when limited by bytes.
+ *
+ * Settings for the Session constructor, 0 meaning unlimited:
+ *   ArenaChunkSize     bytes per chunk, 4MB by default
+ *   ArenaMaxMessages   number of messages retained
+ *   ArenaMaxBytes      bytes of chunks retained
+ *
+ * Like MemoryStore this loses all data on process termination, it is meant
+ * for simulators and load tests.
+ */
+class ArenaStore : public MessageStore, public noncopyable
+{
+public:
+  static const size_t DEFAULT_CHUNK_SIZE = 4 << 20;
+
+  ArenaStore(size_t chunkSize = DEFAULT_CHUNK_SIZE, size_t maxMessages = 0, size_t maxBytes = 0);
+  ArenaStore(const Session& s);
+  ~ArenaStore();
+
+  bool set(const void* data, size_t len);
+  void get(int, int, strvec_t&) const;
+  void get(int, int, msgviews_t&) const;
+
+  // oldest sequence number still retained
+  int getFirstMsgSeqNum() const
+  { return _first; }
+
+  int getNextSenderMsgSeqNum() const
+  { return _nextSenderMsgSeqNum; }
+  int getNextTargetMsgSeqNum() const
+  { return _nextTargetMsgSeqNum; }
+  void setNextSenderMsgSeqNum(int value)
+  { _nextSenderMsgSeqNum = value; }
+  void setNextTargetMsgSeqNum(int value)
+  { _nextTargetMsgSeqNum = value; }
+  void incrNextSenderMsgSeqNum()
+  { ++_nextSenderMsgSeqNum; }
+  void incrNextTargetMsgSeqNum()
+  { ++_nextTargetMsgSeqNum; }
+
+  void setCreationTime(const UtcTimeStamp& creationTime)
+  { _creationTime = creationTime; }
+  UtcTimeStamp getCreationTime() const
+  { return _creationTime; }
+
+  void reset();
+  void refresh() {}
+
+private:
+  struct Chunk
+  {
+    char* mem;
+    size_t size;
+    size_t used;
+    int last; // last sequence number written into this chunk
+  };
+
+  void init();
+  char* allocate(size_t len, int msgSeqNum);
+  void dropBefore(int msgSeqNum);
+  void grow();
+  MsgView& entry(int msgSeqNum) const { return _entries[msgSeqNum & _mask]; }
+
+  size_t _chunkSize;
+  size_t _maxMessages;
+  size_t _maxBytes;
+  MsgView* _entries; // ring indexed by sequence number
+  size_t _mask;
+  int _first; // retained messages are [_first, _end)
+  int _end;
+  std::deque<Chunk> _chunks;
+  std::vector<Chunk> _spare;
+  size_t _chunkBytes;
+  int _nextSenderMsgSeqNum;
+  int _nextTargetMsgSeqNum;
+  UtcTimeStamp _creationTime;
+};
+
 struct StoreFactory
 {
   virtual MessageStore* create(const Session& s) { return new MemoryStore; }
@@ -101,27 +221,54 @@ struct StoreFactoryTmpl : public StoreFactory
  * and one for storing the session creation time.
  *
  * The formats of the files are:
- *   [path]+[BeginString]-[SenderCompID]-[TargetCompID].body
- *   [path]+[BeginString]-[SenderCompID]-[TargetCompID].header
- *   [path]+[BeginString]-[SenderCompID]-[TargetCompID].seqnums
- *   [path]+[BeginString]-[SenderCompID]-[TargetCompID].session
+ *   [path]+[SenderCompID]-[TargetCompID].body
+ *   [path]+[SenderCompID]-[TargetCompID].index
+ *   [path]+[SenderCompID]-[TargetCompID].seqnums
+ *   [path]+[SenderCompID]-[TargetCompID].session
  *
  *
- * The messages file is a pure stream of FIX messages.
- * The sequence number file is in the format of
- *   [SenderMsgSeqNum] : [TargetMsgSeqNum]
+ * The messages file is a pure stream of OUCH messages.
+ * The index file is a preallocated, memory mapped array of fixed width
+ * records indexed by sequence number, record 0 being the file header; each
+ * record holds the offset, length and CRC-32C of a message in the body file.
+ * On open the messages stored since the last sync are checked against their
+ * CRC, the index is cut before the first torn one and the body after the
+ * last intact one; the ones before are not read. A lost index is rebuilt
+ * from the body, whose packets carry their length.
+ * A text .header index left by older versions is converted on first open.
+ * The sequence number file is a memory mapped binary page holding
+ *   [SenderMsgSeqNum] [TargetMsgSeqNum]
+ * which is updated with plain stores, and msync'ed every SeqNumsSyncInterval
+ * updates if set. A "%10.10d : %10.10d" text file left by older versions is
+ * converted on first open.
  * The session file is a UTC timestamp in the format of
  *   YYYYMMDD-HH:MM:SS
+ *
+ * StoreDurability picks what a stored message survives:
+ *   none        left in the FileWriter buffer (FileStoreWriteBuffer, bytes,
+ *               64KB by default) until it fills or is read back
+ *   pagecache   flushed to the kernel per message, survives a process crash
+ *               (default)
+ *   group       flushed per message and fdatasync'ed together with the index
+ *               every StoreSyncCount messages or StoreSyncMicros after the
+ *               oldest unsynced one; with neither set AsyncFileStore syncs
+ *               whenever its queue drains and FileStore per message
+ *
+ * FileStore writes the body with pwrite(2) from the session's thread,
+ * AsyncFileStore from its writer thread through io_uring unless IoUring
+ * is 0.
  */
 class FileStore : public MessageStore
 {
 public:
-  FileStore(const Session& s);
+  // batched by a writer thread, which flushes and writes through io_uring
+  FileStore(const Session& s, bool batched = false);
   virtual ~FileStore();
 
   bool set(const void* data, size_t len);
   bool set(int msgSeqNum, const void* msg, size_t len);
   void get(int, int, strvec_t&) const;
+  void get(int, int, msgviews_t&) const;
 
   int getNextSenderMsgSeqNum() const;
   int getNextTargetMsgSeqNum() const;
@@ -135,36 +282,89 @@ public:
   void reset();
   void refresh();
 
+  enum Durability { DURABILITY_NONE, DURABILITY_PAGECACHE, DURABILITY_GROUP };
+  // called with the highest sequence number known to be on disk after each
+  // sync, on the thread writing the store
+  typedef std::function<void(int)> durable_cb_t;
+  void setDurableCallback(durable_cb_t cb) { _durableCallback = cb; }
+  int getDurableMsgSeqNum() const { return _durable.load(std::memory_order_acquire); }
+  // forces every message written so far to disk
+  virtual void sync();
+
 protected:
-  typedef std::pair<int, int> OffsetSize;
-  typedef std::map<int, OffsetSize> NumToOffset;
+  struct IndexRecord
+  {
+    uint64_t offset;
+    uint32_t len; // 0 if nothing stored under this sequence number
+    uint32_t crc;
+  };
+  struct IndexHeader // takes the place of record 0
+  {
+    char magic[8];
+    uint32_t end; // one past the highest sequence number stored
+    uint32_t checkpoint; // messages before it were synced, and are not checked on open
+  };
+  static const size_t INDEX_INITIAL_RECORDS = 4096; // doubled when exhausted
+  struct SeqNumsPage
+  {
+    char magic[8];
+    std::atomic<int32_t> sender;
+    std::atomic<int32_t> target;
+  };
 
   void open(bool deleteFile);
+  bool openIndex();
+  void migrateHeaderFile();
+  void recover();
+  void rebuildIndex();
+  void openSeqNums();
   void populateCache();
-  bool readFromFile(int offset, int size, std::string& msg);
-  virtual void setSeqNum();
+  void setSeqNum();
+  virtual void syncSeqNums() { _seqNums.sync(); }
   void setSession();
+  virtual bool syncDue() const;
+  SeqNumsPage* seqNums() const { return (SeqNumsPage*)_seqNums.data(); }
 
   bool get(int, std::string&) const;
+  void mapBody(size_t size) const;
+  IndexHeader* indexHeader() const { return (IndexHeader*)_index.data(); }
+  IndexRecord* indexRecord(int n) const { return (IndexRecord*)_index.data() + n; }
 
   MemoryStore _cache;
-  NumToOffset _offsets;
+  MappedFile _index;
+  MappedFile _seqNums;
+  unsigned _seqNumsSyncInterval; // updates between msync, 0 leaves it to the kernel
+  std::atomic<unsigned> _seqNumsDirty; // updates since open
+
+  Durability _durability;
+  int _syncCount; // group commit after this many messages, 0 for no limit
+  int _syncMicros; // or once the oldest unsynced message is this old
+  int _unsynced;
+  struct timespec _firstUnsynced;
+  int _written; // highest sequence number written
+  std::atomic<int> _durable;
+  durable_cb_t _durableCallback;
 
   std::string _msgFileName;
-  std::string _headerFileName;
+  std::string _indexFileName;
+  std::string _headerFileName; // legacy text index, only read for migration
   std::string _seqNumsFileName;
   std::string _sessionFileName;
 
-  FILE* _msgFile;
-  FILE* _headerFile;
-  FILE* _seqNumsFile;
+  mutable FileWriter _bodyFile; // flushed by const retrieval
+  bool _batched; // flushed by the owner rather than per message
   FILE* _sessionFile;
+
+  // read only map of the body file for retrieval, grown lazily
+  mutable char* _body;
+  mutable size_t _bodySize;
 };
 
 class AsyncFileStore : public FileStore, public Queue 
 {
 public:
-  AsyncFileStore(const Session& s) : FileStore(s) {}
+  AsyncFileStore(const Session& s);
+  ~AsyncFileStore();
   bool set(const void* data, size_t len)
   {
     int seqnum = getNextSenderMsgSeqNum();
@@ -181,22 +381,58 @@ public:
     if (write(_fd, &value, 8)) {}
     return true;
   }
-  void setSeqNum()
+  void syncSeqNums() { post(SET_SEQNUM, NULL, 0); }
+  void sync() { post(SYNC, NULL, 0); }
+  void get(int begin, int end, strvec_t& result) const
+  { if (end > readable()) barrier(); lock_t l(_mf); FileStore::get(begin, end, result); }
+  void get(int begin, int end, msgviews_t& result) const
+  { if (end > readable()) barrier(); lock_t l(_mf); FileStore::get(begin, end, result); }
+  int readable() const { return _readable.load(std::memory_order_acquire); }
+  void whenReadable(std::function<void()> done) const
+  {
+    if (stopped()) {
+      done();
+      return;
+    }
+    auto p = new std::function<void()>(std::move(done)); // deleted by the writer
+    const_cast<AsyncFileStore*>(this)->post(NOTIFY, &p, sizeof(p));
+  }
+  void in_event(int fd);
+  void stop(bool wait) { Queue::stop(wait); }
+  bool warmUp(bool lock) { return Queue::warmUp(lock); }
+  
+private:
+  bool warmUpThread(bool lock) { lock_t l(_mf); return _bodyFile.warmUp(lock); }
+  void post(int type, const void* data, size_t len)
   {
     lock_t l(_m);
-    Head h(SET_SEQNUM, 0);
-    auto t = getChunk(sizeof(h));
+    Head h(type, len);
+    auto t = getChunk(sizeof(h) + h.len);
     memcpy(t->data + t->tail, &h, sizeof(h));
     t->tail += sizeof(h);
+    memcpy(t->data + t->tail, data, len);
+    t->tail += len;
     uint64_t value = 1;
     if (write(_fd, &value, 8)) {}
   }
-  void get(int begin, int end, strvec_t& result) const { lock_t l(_mf); FileStore::get(begin, end, result); }
-  void in_event(int fd);
-  void stop(bool wait) { Queue::stop(wait); }
-  
-private:
+  // waits until the writer thread has written out everything queued so far,
+  // the body file is only ever written from that thread
+  void barrier() const
+  {
+    if (stopped()) return;
+    std::atomic<bool> done(false);
+    auto p = &done;
+    const_cast<AsyncFileStore*>(this)->post(FLUSH, &p, sizeof(p));
+    while (!done.load(std::memory_order_acquire)) std::this_thread::yield();
+  }
+  bool syncDue() const { return (_syncCount || _syncMicros) && FileStore::syncDue(); }
+  // after the writer thread flushed the body
+  void flushed() { _readable.store(_lastSet, std::memory_order_release); }
+
   mutable SpinMutex _mf; // mutex for get and set, rarely happen at normal runtime 
+  int _lastSet; // the writer's
+  std::atomic<int> _readable; // flushed up to, for get() to skip the barrier
+  int _tfd; // bounds the age of the unsynced tail under group commit, -1 if unused
 };
 
 } // OUCH
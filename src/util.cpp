@@ -7,7 +7,12 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <future>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 namespace OUCH {
 
@@ -134,6 +139,41 @@ int createClientSock(const char* address, int port)
   return fd;
 }
 
+bool resolveHost(const char* name, int port, sockaddr_in& addr)
+{
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(name, NULL, &hints, &result) || !result) return false;
+  addr = *(sockaddr_in*)result->ai_addr;
+  addr.sin_port = htons(port);
+  freeaddrinfo(result);
+  return true;
+}
+
+int connectNonBlocking(const sockaddr_in& addr, bool& pending)
+{
+  auto fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+  if (fd < 0) dieerr("cannot create socket");
+
+  if (setSockOpt(fd, TCP_NODELAY, 1) < 0) 
+    perror("cannot set socket option TCP_NODELAY");
+
+  pending = false;
+  if (connect(fd, (const sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (errno == EINPROGRESS) {
+      pending = true;
+    } else {
+      auto e = errno;
+      closeSock(fd);
+      errno = e;
+      fd = -1;
+    }
+  }
+  return fd;
+}
+
 const char* getPeerName(int socket)
 {
   struct sockaddr_in addr;
@@ -147,9 +187,9 @@ const char* getPeerName(int socket)
     return "UNKNOWN";
 }
 
-int createAcceptor(int port)
+int createAcceptor(int port, bool reusePort)
 {
-  auto fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  auto fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
   if (fd < 0) dieerr("cannot create socket");
 
   if (setSockOpt(fd, TCP_NODELAY, 1) < 0) 
@@ -158,6 +198,9 @@ int createAcceptor(int port)
   if (setSockOpt(fd, SO_REUSEADDR, 1) < 0)
     perror("cannot set socket option SO_REUSEADDR");
 
+  if (reusePort && setSockOpt(fd, SO_REUSEPORT, 1) < 0)
+    perror("cannot set socket option SO_REUSEPORT");
+
   struct sockaddr_in sa;
   bzero(&sa, sizeof(sa));
   sa.sin_family = AF_INET;
@@ -222,9 +265,11 @@ void mkdirs(const std::string& path, bool isfile)
   }
 }
 
-Queue::Queue()
+Queue::Queue(unsigned chunkSize, size_t preallocate)
+: _pool(MYPIPE::ChunkPool<Chunk>::instance(chunkSize))
 {
-  _head = _tail = new Chunk; _spared = NULL;
+  _pool.reserve(preallocate);
+  _head = _tail = _pool.get(); _stopped = false;
   _fd = eventfd(0, EFD_SEMAPHORE);
   _poll.set_pollin(_poll.add_fd(_fd, this));
   _thread = new std::thread([=](){_poll.loop();});
@@ -242,11 +287,308 @@ void Queue::stop(bool wait)
   
   _poll.stop();
   _thread->join();
+  _stopped = true;
 }
 
 Queue::~Queue()
 {
   delete _thread; // to-do, how to make sure exit safely with avoiding message not dumped
+  if (!_stopped) return; // the thread may still be at the chunks
+  while (_head) {
+    auto next = _head->next;
+    _pool.put(_head);
+    _head = next;
+  }
+}
+
+bool Queue::warmUp(bool lock)
+{
+  if (_stopped) return true;
+  bool locked = true;
+  {
+    lock_t l(_m);
+    for (auto c = _head; c; c = c->next)
+      locked &= prefault(c->data + c->tail, c->capacity - c->tail, lock);
+  }
+  auto done = std::make_shared<std::promise<bool> >();
+  _poll.post([=]() { nowUtcStr(); done->set_value(warmUpThread(lock)); });
+  return done->get_future().get() && locked;
+}
+
+bool prefault(void* p, size_t n, bool lock)
+{
+  static const size_t page = getpagesize();
+  auto begin = (char*)p;
+  for (size_t i = 0; i < n; i += page) ((volatile char*)begin)[i] = 0;
+  if (n) ((volatile char*)begin)[n - 1] = 0;
+  return !lock || !n || mlock(begin, n) == 0;
+}
+
+char* tryMapMirrored(size_t size, unsigned memfdFlags, size_t align)
+{
+  auto fd = memfd_create("ring", memfdFlags);
+  if (fd < 0) return NULL;
+  if (ftruncate(fd, size) < 0) {
+    ::close(fd);
+    return NULL;
+  }
+  // reserve both halves first so that nothing else lands in the second,
+  // with slack to start on a multiple of align
+  auto slack = align > (size_t)getpagesize() ? align : 0;
+  auto reserved = (char*)mmap(NULL, 2 * size + slack, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reserved == MAP_FAILED) {
+    ::close(fd);
+    return NULL;
+  }
+  auto data = slack ? (char*)(((uintptr_t)reserved + align - 1) & ~(uintptr_t)(align - 1)) : reserved;
+  if (data > reserved) munmap(reserved, data - reserved);
+  if (reserved + slack > data) munmap(data + 2 * size, reserved + slack - data);
+  for (int i = 0; i < 2; ++i)
+    if (mmap(data + i * size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      auto error = errno;
+      munmap(data, 2 * size);
+      ::close(fd);
+      errno = error;
+      return NULL;
+    }
+  ::close(fd); // the mappings keep it
+  return data;
+}
+
+char* mapMirrored(size_t size)
+{
+  auto data = tryMapMirrored(size);
+  if (!data) dieerr("failed to map ring of %zu bytes", size);
+  return data;
+}
+
+void unmapMirrored(char* data, size_t size)
+{
+  munmap(data, 2 * size);
+}
+
+void* HugePageAllocator::allocate(size_t n)
+{
+  n = round(n);
+  if (_explicit) {
+    auto p = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      ++_huge;
+      return p;
+    }
+    ++_fallbacks;
+  }
+  // over-map by a page so that the range can start on one
+  auto p = (char*)mmap(NULL, n + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) dieerr("failed to map %zu bytes", n);
+  auto aligned = (char*)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+  if (aligned > p) munmap(p, aligned - p);
+  munmap(aligned + n, p + HUGE_PAGE_SIZE - aligned);
+  madvise(aligned, n, MADV_HUGEPAGE); // fails when they are disabled, pages then
+  return aligned;
+}
+
+void HugePageAllocator::deallocate(void* p, size_t n)
+{
+  munmap(p, round(n));
+}
+
+char* HugePageAllocator::mapRing(size_t n)
+{
+  if (_explicit) {
+    auto data = tryMapMirrored(n, MFD_HUGETLB, HUGE_PAGE_SIZE);
+    if (data) {
+      ++_huge;
+      return data;
+    }
+    ++_fallbacks;
+  }
+  auto data = tryMapMirrored(n, 0, HUGE_PAGE_SIZE);
+  if (!data) dieerr("failed to map ring of %zu bytes", n);
+  madvise(data, 2 * n, MADV_HUGEPAGE); // shared memory, per shmem_enabled
+  return data;
+}
+
+void setBufferAllocation(cstr_t& policy)
+{
+  static HugePageAllocator* hugetlb = NULL;
+  static HugePageAllocator* thp = NULL;
+  static std::mutex m;
+  std::lock_guard<std::mutex> l(m);
+  if (policy.empty()) return;
+  auto p = toLower(policy);
+  if (p == "malloc") MYPIPE::Allocator::set(NULL); // the default
+  else if (p == "hugetlb") {
+    if (!hugetlb) hugetlb = new HugePageAllocator(true); // never freed, chunks keep pointing at it
+    MYPIPE::Allocator::set(hugetlb);
+  } else if (p == "thp") {
+    if (!thp) thp = new HugePageAllocator(false);
+    MYPIPE::Allocator::set(thp);
+  } else
+    die("BufferAllocation must be 'malloc', 'hugetlb' or 'thp', not '" + policy + "'");
+}
+
+void MappedFile::open(cstr_t& path, size_t minSize, size_t maxSize)
+{
+  close();
+  _path = path;
+  _fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (_fd < 0) dieerr("Could not open file " + path);
+  struct stat st;
+  if (fstat(_fd, &st)) dieerr("Could not stat file " + path);
+  _size = std::max((size_t)st.st_size, minSize);
+  if ((size_t)st.st_size < _size && posix_fallocate(_fd, 0, _size) && ftruncate(_fd, _size))
+    dieerr("Could not allocate file " + path);
+  void* at = NULL;
+  int flags = MAP_SHARED;
+  if (maxSize > _size) {
+    at = mmap(NULL, maxSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (at == MAP_FAILED) dieerr("Could not reserve map for file " + path);
+    _reserved = maxSize;
+    flags |= MAP_FIXED;
+  }
+  auto p = mmap(at, _size, PROT_READ | PROT_WRITE, flags, _fd, 0);
+  if (p == MAP_FAILED) dieerr("Could not map file " + path);
+  _data = (char*)p;
+}
+
+void MappedFile::close()
+{
+  if (_data) munmap(_data, std::max(_size, _reserved));
+  if (_fd >= 0) ::close(_fd);
+  _data = NULL;
+  _size = 0;
+  _reserved = 0;
+  _fd = -1;
+}
+
+void MappedFile::resize(size_t size)
+{
+  if (size <= _size) return;
+  // reserve the blocks up front so that stores into the map never hit ENOSPC
+  if (posix_fallocate(_fd, 0, size) && ftruncate(_fd, size))
+    dieerr("Could not allocate file " + _path);
+  if (_reserved) {
+    // map the new tail over the reservation, _size is page aligned
+    if (size > _reserved) die("Map of file " + _path + " can not grow beyond its reservation");
+    auto p = mmap(_data + _size, size - _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, _fd, _size);
+    if (p == MAP_FAILED) dieerr("Could not map file " + _path);
+    _size = size;
+    return;
+  }
+  auto p = mremap(_data, _size, size, MREMAP_MAYMOVE);
+  if (p == MAP_FAILED) dieerr("Could not remap file " + _path);
+  _data = (char*)p;
+  _size = size;
+}
+
+void MappedFile::sync(size_t size)
+{
+  if (msync(_data, size ? std::min(size, _size) : _size, MS_SYNC)) dieerr("Could not sync file " + _path);
+}
+
+static struct CrcTable
+{
+  CrcTable()
+  {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+      t[i] = c;
+    }
+  }
+  uint32_t t[256];
+} crcTable;
+
+static uint32_t crc32cTable(uint32_t crc, const unsigned char* p, size_t len)
+{
+  while (len--) crc = crcTable.t[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+// SSE4.2 has CRC-32C as an instruction. One chain of it is bound by the
+// instruction's latency, so long buffers are cut in three interleaved
+// streams whose results are combined by shifting them over the bytes that
+// follow: crc(A B) = shift(crc(A), |B|) ^ crc(0, B) for the raw register.
+static const size_t CRC_LONG = 8192;
+static const size_t CRC_SHORT = 256;
+static uint32_t crcLong[4][256];
+static uint32_t crcShort[4][256];
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cZeros(uint32_t crc, size_t len)
+{
+  uint64_t c = crc;
+  for (; len; len -= 8) c = _mm_crc32_u64(c, 0);
+  return c;
+}
+
+__attribute__((target("sse4.2")))
+static void crc32cShiftTables()
+{
+  for (int k = 0; k < 4; ++k)
+    for (uint32_t b = 0; b < 256; ++b) {
+      crcLong[k][b] = crc32cZeros(b << (8 * k), CRC_LONG);
+      crcShort[k][b] = crc32cZeros(b << (8 * k), CRC_SHORT);
+    }
+}
+
+static inline uint32_t crc32cShift(uint32_t (*t)[256], uint32_t crc)
+{
+  return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^ t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const unsigned char* p, size_t len)
+{
+  for (; len && ((uintptr_t)p & 7); --len) crc = _mm_crc32_u8(crc, *p++);
+  uint64_t c0 = crc;
+  for (; len >= 3 * CRC_LONG; len -= 3 * CRC_LONG, p += 3 * CRC_LONG) {
+    uint64_t c1 = 0, c2 = 0;
+    for (auto q = p, end = p + CRC_LONG; q < end; q += 8) {
+      c0 = _mm_crc32_u64(c0, *(const uint64_t*)q);
+      c1 = _mm_crc32_u64(c1, *(const uint64_t*)(q + CRC_LONG));
+      c2 = _mm_crc32_u64(c2, *(const uint64_t*)(q + 2 * CRC_LONG));
+    }
+    c0 = crc32cShift(crcLong, c0) ^ c1;
+    c0 = crc32cShift(crcLong, c0) ^ c2;
+  }
+  for (; len >= 3 * CRC_SHORT; len -= 3 * CRC_SHORT, p += 3 * CRC_SHORT) {
+    uint64_t c1 = 0, c2 = 0;
+    for (auto q = p, end = p + CRC_SHORT; q < end; q += 8) {
+      c0 = _mm_crc32_u64(c0, *(const uint64_t*)q);
+      c1 = _mm_crc32_u64(c1, *(const uint64_t*)(q + CRC_SHORT));
+      c2 = _mm_crc32_u64(c2, *(const uint64_t*)(q + 2 * CRC_SHORT));
+    }
+    c0 = crc32cShift(crcShort, c0) ^ c1;
+    c0 = crc32cShift(crcShort, c0) ^ c2;
+  }
+  for (; len >= 8; len -= 8, p += 8) c0 = _mm_crc32_u64(c0, *(const uint64_t*)p);
+  crc = c0;
+  for (; len; --len) crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
+
+typedef uint32_t (*crc32c_t)(uint32_t, const unsigned char*, size_t);
+
+static crc32c_t pickCrc32c()
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32cShiftTables();
+    return crc32cSse42;
+  }
+#endif
+  return crc32cTable;
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len)
+{
+  static const crc32c_t impl = pickCrc32c(); // may be needed by static constructors
+  return ~impl(~crc, (const unsigned char*)data, len);
 }
 
 static __thread char* tmp;
@@ -266,3 +608,14 @@ const char* nowUtcStr()
 }
 
 } // namespace OUCH
+
+// the default rings, plain pages
+char* MYPIPE::Allocator::mapRing(size_t n)
+{
+  return OUCH::mapMirrored(n);
+}
+
+void MYPIPE::Allocator::unmapRing(char* p, size_t n)
+{
+  OUCH::unmapMirrored(p, n);
+}
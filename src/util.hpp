@@ -2,9 +2,11 @@
 #define OUCH_UTIL_HPP
 
 #include "epoll.hpp"
+#include "pipe.hpp"
 
 #include <stdarg.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <algorithm> 
 #include <functional> 
@@ -127,7 +129,14 @@ const char* getHostName(int socket);
 const char* getHostName(const char* name);
 const char* getPeerName(int socket);
 int createClientSock(const char* address, int port);
-int createAcceptor(int port);
+// thread safe lookup, for resolving once ahead of connecting
+bool resolveHost(const char* name, int port, sockaddr_in& addr);
+// starts connecting without blocking; pending is set if the connect is
+// still in progress, it is done when the socket turns writable
+int connectNonBlocking(const sockaddr_in& addr, bool& pending);
+// non blocking; with reusePort several acceptors can share the port, the
+// kernel spreading connections across them
+int createAcceptor(int port, bool reusePort=false);
 void closeSock(int fd);
 void mkdirs(const std::string& path, bool isfile=false);
 sections_t readSettings(std::istream& stream);
@@ -138,6 +147,12 @@ inline int setTimer(int fd, int seconds, int interval)
   return timerfd_settime(fd, 0, &newtime, NULL); // relative timer
 }
 
+inline int setTimerMs(int fd, int ms)
+{
+  struct itimerspec newtime = {{0, 0}, {ms / 1000, ms % 1000 * 1000000L}};
+  return timerfd_settime(fd, 0, &newtime, NULL); // relative one shot timer
+}
+
 static inline void mystrftime(const char* pattern, char* out, int len, struct tm* timeinfo=NULL) 
 {
   if (timeinfo) {
@@ -193,20 +208,21 @@ private:
 static const unsigned CHUNK_SIZE = 1024 * 1024;
 struct Chunk
 {
-  Chunk(unsigned n=CHUNK_SIZE) : head(0), tail(0), capacity(std::max(n, CHUNK_SIZE)), data((char*)malloc(capacity)), next(NULL) {} 
-  ~Chunk() { free(data); }
+  Chunk(unsigned n=CHUNK_SIZE, unsigned min=CHUNK_SIZE) : head(0), tail(0), capacity(std::max(n, min)), allocator(MYPIPE::Allocator::get()), data((char*)allocator->allocate(capacity)), next(NULL) {} 
+  ~Chunk() { allocator->deallocate(data, capacity); }
   void reset() { head = 0; tail = 0; next = NULL; }
-  void resize(unsigned n) { capacity = n; free(data); data = (char*)malloc(n); }
+  void resize(unsigned n) { allocator->deallocate(data, capacity); capacity = n; data = (char*)allocator->allocate(n); }
   uint32_t head;
   uint32_t tail; 
   uint32_t capacity;
+  MYPIPE::Allocator* allocator;
   char* data;
   Chunk* next;
 };
 
 struct Queue : public i_poll_events
 {
-  enum {SET, SET_SEQNUM, LOG, EVENT, UNKNOWN};
+  enum {SET, SET_SEQNUM, LOG, EVENT, SYNC, FLUSH, NOTIFY, UNKNOWN};
   struct Head { unsigned type:3; unsigned len:29; Head():type(UNKNOWN),len(0){}; Head(int t, int l):type(t), len(l){} };
   Chunk* getChunk(size_t n)
   {
@@ -216,14 +232,7 @@ struct Queue : public i_poll_events
     if (remained >= n) {
       t = _tail;
     } else {
-      if (_spared) {
-        t = _spared;
-        _spared = NULL;
-        t->reset();
-        if (t->capacity < n) t->resize(n);
-      } else {
-        t = new Chunk(n);
-      }
+      t = _pool.get(n);
       _tail->next = t;
       _tail = t;
     }
@@ -235,8 +244,7 @@ struct Queue : public i_poll_events
     if (_head->tail == _head->head) {
       assert(_head != _tail);
       auto next = _head->next;
-      if (_spared) delete _head;
-      else _spared = _head;
+      _pool.put(_head);
       _head = next;
     }
     _h = (Head*)(_head->data + _head->head);
@@ -246,25 +254,115 @@ struct Queue : public i_poll_events
     lock_t l(_m);
     _head->head += sizeof(*_h) + _h->len;
   }
+  bool drained()
+  {
+    lock_t l(_m);
+    return _head == _tail && _head->tail == _head->head;
+  }
 
-  Queue();
+  // chunks of chunkSize from the pool of that size, which is grown to
+  // preallocate chunks up front
+  Queue(unsigned chunkSize=CHUNK_SIZE, size_t preallocate=0);
+  // faults in, and with lock pins, the room left in the queued chunks, and
+  // has the queue thread set up its thread-locals and warmUpThread();
+  // false if pinning failed
+  bool warmUp(bool lock);
   void stop(bool wait=true);
+  bool stopped() const { return _stopped; }
   virtual ~Queue();
 
 protected:
+  // on the queue thread, for what it alone touches, like its writers
+  virtual bool warmUpThread(bool lock) { return true; }
+
   // not sure if std::condition_variable or using semaphore directly is better solution.
   // sem_wait has no timeout
   epoll_t _poll; 
   int _fd; // eventfd 
   SpinMutex _m;
   typedef SpinMutex::Locker lock_t;
+  MYPIPE::ChunkPool<Chunk>& _pool;
   Chunk* _head;
   Chunk* _tail;
-  Chunk* _spared; 
   Head* _h;
   std::thread* _thread;
+  bool _stopped;
 };
 
+// writes a byte in every page of p, which must be unused memory, so that
+// later writes do not fault, and with lock mlock()s them too; false if
+// that failed, e.g. beyond RLIMIT_MEMLOCK
+bool prefault(void* p, size_t n, bool lock=false);
+
+// size bytes of memory mapped twice, back to back, so that a ring buffer in
+// it can be read and written across its end as one contiguous range; size
+// must be a multiple of the page size
+char* mapMirrored(size_t size);
+void unmapMirrored(char* data, size_t size);
+// the same, or NULL with errno set; memfdFlags go to memfd_create(), and
+// the mapping starts at a multiple of align, a power of two
+char* tryMapMirrored(size_t size, unsigned memfdFlags=0, size_t align=0);
+
+// Chunks and receive rings in 2MB pages, which take far fewer TLB entries
+// than 4KB ones. Explicit huge pages (MAP_HUGETLB) have to be reserved in
+// /proc/sys/vm/nr_hugepages; when they run out, or with explicit false,
+// the memory is 2MB aligned and advised for transparent huge pages, and
+// when those are disabled too it is just pages. Every buffer is rounded
+// up to 2MB, so small chunks are better made bigger and fewer.
+class HugePageAllocator : public MYPIPE::Allocator
+{
+public:
+  static const size_t HUGE_PAGE_SIZE = 2 << 20;
+  HugePageAllocator(bool explicitPages) : _explicit(explicitPages), _huge(0), _fallbacks(0) {}
+  void* allocate(size_t n);
+  void deallocate(void* p, size_t n);
+  size_t ringSize(size_t n) { return round(n); }
+  char* mapRing(size_t n);
+  // buffers in explicit huge pages, and those that had to fall back
+  size_t huge() const { return _huge; }
+  size_t fallbacks() const { return _fallbacks; }
+
+private:
+  static size_t round(size_t n) { return (n + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1); }
+  bool _explicit;
+  std::atomic<size_t> _huge;
+  std::atomic<size_t> _fallbacks;
+};
+
+// BufferAllocation: malloc, the default; hugetlb, explicit huge pages
+// falling back to transparent ones; or thp, transparent ones only. Set
+// for the whole process, before the first session is created.
+void setBufferAllocation(cstr_t& policy);
+
+// A file shared-mapped read/write, grown by reserving more disk space and
+// remapping; data() may move on resize().
+class MappedFile : public noncopyable
+{
+public:
+  MappedFile() : _fd(-1), _data(NULL), _size(0), _reserved(0) {}
+  ~MappedFile() { close(); }
+  // with maxSize the address range for that many bytes is reserved up front
+  // and resize() grows the map in place, so data() never moves
+  void open(cstr_t& path, size_t minSize, size_t maxSize = 0);
+  void close();
+  void resize(size_t size);
+  void sync(size_t size = 0); // the first size bytes, all by default
+  char* data() const { return _data; }
+  size_t size() const { return _size; }
+  bool isOpen() const { return _fd >= 0; }
+
+private:
+  int _fd;
+  char* _data;
+  size_t _size;
+  size_t _reserved;
+  str_t _path;
+};
+
+// CRC-32C (Castagnoli), pass the previous result to checksum in pieces; uses
+// the SSE4.2 instruction when the CPU has it
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
 const char* nowUtcStr();
 } // namespace OUCH
 
@@ -0,0 +1,331 @@
+#include "writer.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define OUCH_HAVE_IO_URING
+#endif
+#endif
+
+using namespace OUCH;
+
+// io_uring, mapped by hand to avoid a liburing dependency. One per thread
+// that writes, each writer has at most one write in flight on it.
+struct FileWriter::Ring : public noncopyable
+{
+  static std::shared_ptr<Ring> local();
+  Ring();
+  ~Ring();
+  void submit(Buffer& b, size_t len);
+  void reap(); // one completion, waits for it
+
+  int fd;
+  unsigned entries; // of the completion queue
+  unsigned inflight;
+  void* sqMap;
+  size_t sqMapSize;
+  void* cqMap;
+  size_t cqMapSize;
+  void* sqes;
+  size_t sqesSize;
+  unsigned* sqTail;
+  unsigned* sqMask;
+  unsigned* sqArray;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned* cqMask;
+  void* cqes;
+};
+
+// the ring of this thread, NULL if the kernel does not let us have one
+std::shared_ptr<FileWriter::Ring> FileWriter::Ring::local()
+{
+  static thread_local std::weak_ptr<Ring> current;
+  auto ring = current.lock();
+  if (ring) return ring;
+  ring = std::make_shared<Ring>();
+  if (ring->fd < 0) return NULL;
+  current = ring;
+  return ring;
+}
+
+FileWriter::Ring::Ring()
+: fd(-1), entries(0), inflight(0), sqMap(NULL), cqMap(NULL), sqes(NULL)
+{
+#ifdef OUCH_HAVE_IO_URING
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  fd = syscall(__NR_io_uring_setup, 16, &p);
+  if (fd < 0) return; // not compiled in or not permitted, pwrite it is
+  entries = p.cq_entries;
+  sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+  sqMap = mmap(NULL, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  cqMap = p.features & IORING_FEAT_SINGLE_MMAP ? sqMap
+    : mmap(NULL, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqMap == MAP_FAILED || cqMap == MAP_FAILED || sqes == MAP_FAILED) {
+    if (sqMap == MAP_FAILED) sqMap = NULL;
+    if (cqMap == MAP_FAILED) cqMap = NULL;
+    if (sqes == MAP_FAILED) sqes = NULL;
+    if (sqes) munmap(sqes, sqesSize);
+    if (cqMap && cqMap != sqMap) munmap(cqMap, cqMapSize);
+    if (sqMap) munmap(sqMap, sqMapSize);
+    ::close(fd);
+    fd = -1;
+    return;
+  }
+  auto sq = (char*)sqMap;
+  auto cq = (char*)cqMap;
+  sqTail = (unsigned*)(sq + p.sq_off.tail);
+  sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+  sqArray = (unsigned*)(sq + p.sq_off.array);
+  cqHead = (unsigned*)(cq + p.cq_off.head);
+  cqTail = (unsigned*)(cq + p.cq_off.tail);
+  cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+  cqes = cq + p.cq_off.cqes;
+#endif
+}
+
+// writers wait for their writes before closing, and hold the ring until then
+FileWriter::Ring::~Ring()
+{
+  if (fd < 0) return;
+  munmap(sqes, sqesSize);
+  if (cqMap != sqMap) munmap(cqMap, cqMapSize);
+  munmap(sqMap, sqMapSize);
+  ::close(fd);
+}
+
+void FileWriter::Ring::submit(Buffer& b, size_t len)
+{
+#ifdef OUCH_HAVE_IO_URING
+  if (inflight == entries) reap(); // room for the completion
+  b.iov.iov_base = b.data;
+  b.iov.iov_len = len;
+  auto tail = *sqTail;
+  auto index = tail & *sqMask;
+  auto sqe = (struct io_uring_sqe*)sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = b.writer->_fd;
+  sqe->addr = (uint64_t)&b.iov;
+  sqe->len = 1;
+  sqe->off = b.offset;
+  sqe->user_data = (uint64_t)&b;
+  sqArray[index] = index;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+  if (syscall(__NR_io_uring_enter, fd, 1, 0, 0, NULL, 0) < 0)
+    dieerr("Unable to submit write to " + b.writer->_path);
+  b.busy = true;
+  ++inflight;
+#endif
+}
+
+void FileWriter::Ring::reap()
+{
+#ifdef OUCH_HAVE_IO_URING
+  while (true) {
+    auto head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      if (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+        dieerr("Unable to wait for writes");
+      continue;
+    }
+    auto cqe = (struct io_uring_cqe*)cqes + (head & *cqMask);
+    auto done = (Buffer*)cqe->user_data;
+    auto res = cqe->res;
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    --inflight;
+    done->busy = false;
+    if (res < 0) {
+      errno = -res;
+      dieerr("Unable to write to " + done->writer->_path);
+    }
+    if ((size_t)res < done->iov.iov_len) // short write, finish it the slow way
+      done->writer->pwriteAll(done->data + res, done->iov.iov_len - res, done->offset + res);
+    return;
+  }
+#endif
+}
+
+FileWriter::FileWriter(size_t bufferSize, int flags, size_t preallocate)
+: _capacity(std::max((size_t)ALIGNMENT, (bufferSize + ALIGNMENT - 1) & ~(ALIGNMENT - 1))),
+  _flags(flags), _preallocate(preallocate), _allocated(0), _submitted(0), _cur(0), _fd(-1), _direct(false)
+{
+  for (int i = 0; i < 2; ++i) {
+    void* p;
+    if (posix_memalign(&p, ALIGNMENT, _capacity)) die("Unable to allocate write buffer");
+    _buf[i].writer = this;
+    _buf[i].data = (char*)p;
+    _buf[i].used = 0;
+    _buf[i].offset = 0;
+    _buf[i].busy = false;
+  }
+}
+
+FileWriter::~FileWriter()
+{
+  close();
+  free(_buf[0].data);
+  free(_buf[1].data);
+}
+
+void FileWriter::open(cstr_t& path)
+{
+  close();
+  _path = path;
+  _direct = _flags & DIRECT;
+  _fd = ::open(path.c_str(), O_RDWR | O_CREAT | (_direct ? O_DIRECT : 0), 0644);
+  if (_fd < 0 && _direct && errno == EINVAL) {
+    // tmpfs and friends do not support O_DIRECT
+    _direct = false;
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  }
+  if (_fd < 0) dieerr("Could not open file " + path);
+  struct stat st;
+  if (fstat(_fd, &st)) dieerr("Could not stat file " + path);
+  _allocated = _submitted = st.st_size;
+  auto& b = _buf[_cur];
+  b.offset = st.st_size;
+  b.used = 0;
+  if (_direct) {
+    // direct writes start on a block boundary, carry the partial block over
+    b.used = st.st_size % ALIGNMENT;
+    b.offset -= b.used;
+    if (b.used && pread(_fd, b.data, ALIGNMENT, b.offset) < (ssize_t)b.used)
+      dieerr("Could not read file " + path);
+  }
+}
+
+void FileWriter::close()
+{
+  if (_fd < 0) return;
+  flush();
+  if (_direct && ftruncate(_fd, size())) dieerr("Could not truncate file " + _path);
+  ::close(_fd);
+  _fd = -1;
+  _ring.reset(); // nothing in flight, the next open writes from wherever it is
+}
+
+uint64_t FileWriter::append(const void* data, size_t len)
+{
+  auto offset = size();
+  auto p = (const char*)data;
+  while (len) {
+    auto& b = _buf[_cur];
+    auto n = std::min(len, _capacity - b.used);
+    memcpy(b.data + b.used, p, n);
+    b.used += n;
+    p += n;
+    len -= n;
+    if (b.used == _capacity) rotate();
+  }
+  return offset;
+}
+
+bool FileWriter::warmUp(bool lock)
+{
+  bool locked = true;
+  for (auto& b : _buf)
+    if (!b.busy) locked &= prefault(b.data + b.used, _capacity - b.used, lock);
+  return locked;
+}
+
+void FileWriter::flush(bool wait)
+{
+  if (_fd < 0) return;
+  if (size() > _submitted) rotate();
+  if (wait) {
+    this->wait(_buf[0]);
+    this->wait(_buf[1]);
+  }
+}
+
+void FileWriter::syncData()
+{
+  flush();
+  if (_fd >= 0 && fdatasync(_fd)) dieerr("Unable to sync file " + _path);
+}
+
+int FileWriter::overflow(int c)
+{
+  if (c != traits_type::eof()) {
+    char ch = c;
+    append(&ch, 1);
+  }
+  return traits_type::not_eof(c);
+}
+
+std::streamsize FileWriter::xsputn(const char* s, std::streamsize n)
+{
+  append(s, n);
+  return n;
+}
+
+// Submits the current buffer and switches to the other one. Only one write
+// is in flight at a time, so a padded block is never rewritten before the
+// previous write of it has completed.
+void FileWriter::rotate()
+{
+  auto& b = _buf[_cur];
+  auto& n = _buf[_cur ^ 1];
+  wait(n);
+  size_t keep = 0, len = b.used;
+  if (_direct) {
+    keep = b.used % ALIGNMENT;
+    if (keep) {
+      len += ALIGNMENT - keep;
+      memset(b.data + b.used, 0, len - b.used);
+    }
+  }
+  submit(b, len);
+  _submitted = b.offset + b.used;
+  n.offset = b.offset + b.used - keep;
+  n.used = keep;
+  if (keep) memcpy(n.data, b.data + b.used - keep, keep);
+  _cur ^= 1;
+}
+
+void FileWriter::submit(Buffer& b, size_t len)
+{
+  auto end = b.offset + len;
+  if (_preallocate && end > _allocated) {
+    auto n = std::max((uint64_t)_preallocate, end - _allocated);
+    if (!fallocate(_fd, FALLOC_FL_KEEP_SIZE, _allocated, n)) _allocated += n;
+    else _preallocate = 0; // not supported here, stop trying
+  }
+  if (!_ring && !(_flags & NO_URING)) {
+    _ring = Ring::local();
+    if (!_ring) _flags |= NO_URING; // not here, not on the next write either
+  }
+  if (_ring) _ring->submit(b, len);
+  else pwriteAll(b.data, len, b.offset);
+}
+
+void FileWriter::wait(Buffer& b)
+{
+  while (b.busy) _ring->reap();
+}
+
+void FileWriter::pwriteAll(const char* p, size_t len, uint64_t offset)
+{
+  while (len) {
+    auto n = pwrite(_fd, p, len, offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      dieerr("Unable to write to " + _path);
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+}
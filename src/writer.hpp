@@ -0,0 +1,97 @@
+#ifndef OUCH_WRITER_HPP
+#define OUCH_WRITER_HPP
+
+#include "util.hpp"
+
+#include <memory>
+#include <streambuf>
+#include <sys/uio.h>
+
+namespace OUCH {
+
+/**
+ * Append only file writer batching records into large aligned buffers.
+ *
+ * Two buffers alternate, one is filled while the kernel writes the other,
+ * through io_uring when the kernel has it and pwrite(2) otherwise. Nothing
+ * reaches the file before flush() or a full buffer. A writer uses the ring
+ * of the thread it first writes from, shared with the other writers of that
+ * thread and kept for as long as one of them is open.
+ *
+ * With DIRECT the file is opened O_DIRECT where the file system allows it.
+ * The last partial block is then written zero padded and rewritten by the
+ * next flush, close() truncates the file back to its logical size.
+ * preallocate reserves disk space that many bytes at a time ahead of the
+ * writes, without changing the file size.
+ *
+ * It is also a streambuf, text can be formatted straight into the buffer:
+ *   std::ostream out(&writer);
+ *
+ * Not thread safe, the owner serializes access, also with the writers
+ * sharing its ring.
+ */
+class FileWriter : public std::streambuf, public noncopyable
+{
+public:
+  enum Flags { DIRECT = 1, NO_URING = 2 };
+  static const size_t ALIGNMENT = 4096; // of buffers, and of offsets and lengths with DIRECT
+  // each writer holds two, small by default as stores and logs have one
+  // writer per session
+  static const int DEFAULT_BUFFER_SIZE = 64 << 10;
+
+  FileWriter(size_t bufferSize = DEFAULT_BUFFER_SIZE, int flags = 0, size_t preallocate = 0);
+  ~FileWriter();
+
+  void open(cstr_t& path);
+  void close();
+  bool isOpen() const { return _fd >= 0; }
+  int fd() const { return _fd; }
+  bool direct() const { return _direct; }
+  bool uring() const { return _ring != NULL; }
+  uint64_t size() const { return _buf[_cur].offset + _buf[_cur].used; } // including buffered bytes
+
+  uint64_t append(const void* data, size_t len); // returns the offset written at
+  void flush(bool wait = true); // hands buffered bytes to the kernel
+  void syncData(); // flush and fdatasync
+  bool warmUp(bool lock); // faults in, or pins, the room in idle buffers
+
+protected:
+  int overflow(int c);
+  int sync() { flush(false); return 0; }
+  std::streamsize xsputn(const char* s, std::streamsize n);
+
+private:
+  struct Buffer
+  {
+    FileWriter* writer; // completions on a shared ring may be any writer's
+    char* data;
+    size_t used;
+    uint64_t offset; // file offset of data[0]
+    bool busy; // submitted to the ring and not completed yet
+    struct iovec iov;
+  };
+
+  void rotate();
+  void submit(Buffer& b, size_t len);
+  void wait(Buffer& b);
+  void pwriteAll(const char* p, size_t len, uint64_t offset);
+
+  struct Ring;
+
+  size_t _capacity;
+  int _flags;
+  size_t _preallocate;
+  uint64_t _allocated; // end of the space reserved so far
+  uint64_t _submitted; // end of the data handed to the kernel
+  Buffer _buf[2];
+  int _cur;
+  int _fd;
+  bool _direct;
+  str_t _path;
+
+  std::shared_ptr<Ring> _ring; // taken on the first write unless NO_URING
+};
+
+} // namespace OUCH
+
+#endif